@@ -0,0 +1,210 @@
+// ****************************************************************************
+// In-situ analysis: radial profiles, rotation curves, speed dispersions and
+// Fourier modes of the visible stars, overlapping with the next frames.
+// See analysis.hpp for the output format.
+// ****************************************************************************
+
+#include "analysis.hpp"
+
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <semaphore>
+#include <thread>
+#include <vector>
+#include "common.hpp"
+#include "memory.hpp"
+#include "world.hpp"
+
+struct sample
+{
+    double x, y;
+    double vx, vy;
+    double mass;
+};
+
+// Sums over the stars of a radial bin, weighted by mass
+struct bin
+{
+    int stars;
+    double mass;
+    double vr, vr2;
+    double vphi, vphi2;
+    std::vector<double> re, im;  // of Σ m e^(ikφ), k = 1..AnalysisModes
+};
+
+static FILE* output = NULL;
+static sample* samples = NULL;  // the snapshot being reduced
+static int sample_count = 0;
+static int sample_capacity = 0;
+static double sample_time;
+static std::vector<bin> bins;
+
+static std::thread analyst;
+static std::binary_semaphore analysis_start(0);
+static std::binary_semaphore analysis_done(0);
+static bool analysis_busy = false;  // main thread only
+static bool analyst_stop = false;
+static long frame = 0;
+
+static void reduce()
+{
+    double mass = 0;
+    double x = 0, y = 0, vx = 0, vy = 0;
+    for (int i = 0; i < sample_count; i++) {
+        const sample& s = samples[i];
+        mass += s.mass;
+        x += s.mass * s.x;
+        y += s.mass * s.y;
+        vx += s.mass * s.vx;
+        vy += s.mass * s.vy;
+    }
+    if (mass > 0) {
+        x /= mass;
+        y /= mass;
+        vx /= mass;
+        vy /= mass;
+    }
+
+    int modes = config.analysis_modes;
+    double width = config.analysis_radius / bins.size();
+    for (bin& b : bins) {
+        b.stars = 0;
+        b.mass = b.vr = b.vr2 = b.vphi = b.vphi2 = 0;
+        b.re.assign(modes, 0);
+        b.im.assign(modes, 0);
+    }
+    for (int i = 0; i < sample_count; i++) {
+        const sample& s = samples[i];
+        double dx = s.x - x;
+        double dy = s.y - y;
+        double r = sqrt(dx*dx + dy*dy);
+        if (r >= config.analysis_radius || r == 0)
+            continue;
+        bin& b = bins[(int)(r / width)];
+        double cos1 = dx / r;
+        double sin1 = dy / r;
+        double vr = (s.vx - vx) * cos1 + (s.vy - vy) * sin1;
+        double vphi = (s.vy - vy) * cos1 - (s.vx - vx) * sin1;
+        b.stars++;
+        b.mass += s.mass;
+        b.vr += s.mass * vr;
+        b.vr2 += s.mass * vr * vr;
+        b.vphi += s.mass * vphi;
+        b.vphi2 += s.mass * vphi * vphi;
+        double c = cos1;  // cos kφ and sin kφ by rotation, no trigonometry
+        double sn = sin1;
+        for (int k = 0; k < modes; k++) {
+            b.re[k] += s.mass * c;
+            b.im[k] += s.mass * sn;
+            double next = c * cos1 - sn * sin1;
+            sn = sn * cos1 + c * sin1;
+            c = next;
+        }
+    }
+
+    unsigned stats = config.analysis_stats;
+    fprintf(output, "# time %g, %d stars, center %g %g\n# r", sample_time, sample_count, x, y);
+    if (stats & Config::analyze_profile)
+        fprintf(output, " n density");
+    if (stats & Config::analyze_rotation)
+        fprintf(output, " vphi");
+    if (stats & Config::analyze_dispersion)
+        fprintf(output, " sigma_r sigma_phi");
+    if (stats & Config::analyze_modes)
+        for (int k = 1; k <= modes; k++)
+            fprintf(output, " A%d", k);
+    fprintf(output, "\n");
+    for (size_t i = 0; i < bins.size(); i++) {
+        const bin& b = bins[i];
+        double m = fmax(b.mass, DBL_MIN);
+        fprintf(output, "%g", (i + 0.5) * width);
+        if (stats & Config::analyze_profile)
+            fprintf(output, " %d %g", b.stars, b.mass / (M_PI * width * width * (2*i + 1)));
+        if (stats & Config::analyze_rotation)
+            fprintf(output, " %g", b.vphi / m);
+        if (stats & Config::analyze_dispersion)
+            fprintf(output, " %g %g", sqrt(fmax(b.vr2/m - (b.vr/m) * (b.vr/m), 0)),
+                    sqrt(fmax(b.vphi2/m - (b.vphi/m) * (b.vphi/m), 0)));
+        if (stats & Config::analyze_modes)
+            for (int k = 0; k < modes; k++)
+                fprintf(output, " %g", hypot(b.re[k], b.im[k]) / m);
+        fprintf(output, "\n");
+    }
+    fflush(output);
+}
+
+static void analyst_loop()
+{
+    for (;;) {
+        analysis_start.acquire();
+        if (analyst_stop)
+            return;
+        reduce();
+        analysis_done.release();
+    }
+}
+
+static void copy_samples(int thread)
+{
+    int count = config.stars - first_visible;
+    int end = (int)((long)count * (thread + 1) / cores);
+    for (int i = (int)((long)count * thread / cores); i < end; i++) {
+        int j = first_visible + i;
+        samples[i] = { stars[j].x, stars[j].y, motion.vx[j], motion.vy[j], stars[j].mass };
+    }
+}
+
+void init_analysis()
+{
+    if (config.analysis_every <= 0 || config.analysis_output.empty())
+        return;
+    output = fopen(config.analysis_output.c_str(), "a");
+    if (!output) {
+        fprintf(stderr, "Cannot open '%s': %s\n", config.analysis_output.c_str(), strerror(errno));
+        return;
+    }
+    bins.resize(config.analysis_bins);
+    analyst = std::thread(analyst_loop);
+}
+
+// Hand a snapshot over every AnalysisEvery frames, after the previous one is done
+void analysis_frame()
+{
+    if (!output || frame++ % config.analysis_every)
+        return;
+    if (analysis_busy)
+        analysis_done.acquire();
+    sample_count = config.stars - first_visible;
+    if (sample_capacity < sample_count) {
+        sample_capacity = std::max(sample_count, 2 * sample_capacity);
+        samples = (sample*)tracked_realloc(memory_analysis, samples, sample_capacity * sizeof(sample));
+    }
+    sample_time = world_time;
+    run_pool(copy_samples);
+    analysis_busy = true;
+    analysis_start.release();
+}
+
+void finalize_analysis()
+{
+    if (analyst.joinable()) {
+        if (analysis_busy)
+            analysis_done.acquire();
+        analysis_busy = false;
+        analyst_stop = true;
+        analysis_start.release();
+        analyst.join();
+    }
+    if (output) {
+        fclose(output);
+        output = NULL;
+    }
+    tracked_free(samples);
+    samples = NULL;
+    sample_capacity = 0;
+}
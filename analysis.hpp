@@ -0,0 +1,20 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+// In-situ analysis of the visible stars every AnalysisEvery frames.
+//
+// A snapshot is copied on the thread pool and reduced on a dedicated thread
+// while the simulation goes on; only the results are written. Each block of
+// AnalysisOutput starts with the time, the star count and the center of
+// mass, then has one line per radial bin around it:
+//   r              middle of the bin
+//   n density      stars and surface density (profile)
+//   vphi           mean tangential speed, the rotation curve (rotation)
+//   sigma_r sigma_phi  speed dispersions (dispersion)
+//   A1 .. Am       azimuthal Fourier amplitudes |Σ m e^(imφ)| / Σ m (modes)
+
+void init_analysis();
+void analysis_frame();
+void finalize_analysis();
+
+#endif // ANALYSIS_H
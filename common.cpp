@@ -4,13 +4,21 @@
 #include <fstream>
 #include <regex>
 #include <sstream>
+#include <stdio.h>
 #include <thread>
 #include <vector>
-#include <GLFW/glfw3.h>
 #include "common.hpp"
 
-vec2* disp_star_position = nullptr;  // display coordinates, float
-vec3* disp_star_color = nullptr;  // star colors
+int disp_stars = 0;  // number of displayed stars
+int disp_star_capacity = 0;
+float2* disp_star_position = nullptr;  // display coordinates, float
+float3* disp_star_color = nullptr;  // star colors
+int disp_star_color_version = 0;
+int disp_star_recolor_version = 0;
+int disp_tracers = 0;
+float2* disp_tracer_position = nullptr;
+picked_star disp_picked = { -1, 0, { 0, 0 }, { 0, 0 } };
+field_image disp_field = { nullptr, 0, 0, 0, 0, 0, 0, 0 };
 
 std::string read_file(const std::string& filename)
 {
@@ -22,17 +30,24 @@ std::string read_file(const std::string& filename)
     return content;
 }
 
+// Monotonic time in seconds, available without a window
+double get_time()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
 // returns actual frame duration
 double frame_sleep()
 {
     static double last_time = -1.0;
     if (last_time < 0)
-        last_time = glfwGetTime() - 1.0/config.max_fps;
-    double last_interval = glfwGetTime() - last_time;
+        last_time = get_time() - 1.0/config.max_fps;
+    double last_interval = get_time() - last_time;
     double sleep_interval = 1.0/config.max_fps - last_interval;
     if (sleep_interval > 0)
         std::this_thread::sleep_for(std::chrono::microseconds((int)(1e6 * sleep_interval)));
-    last_interval = glfwGetTime() - last_time;
+    last_interval = get_time() - last_time;
     last_time += last_interval;
     add_fps(1 / last_interval);
     return last_interval;
@@ -59,28 +74,165 @@ void Config::load(const std::string& filename)
             const std::string& value = match[2].str();
             switch (key) {
             case Parameter::stars:          config.stars          = std::stoi(value); break;
+            case Parameter::tracers:        config.tracers        = std::stoi(value); break;
             case Parameter::galaxy_density: config.galaxy_density = std::stod(value); break;
             case Parameter::star_speed:     config.star_speed     = std::stod(value); break;
             case Parameter::gravity:        config.gravity        = std::stod(value); break;
             case Parameter::epsilon:        config.epsilon        = std::stod(value); break;
             case Parameter::accuracy:       config.accuracy       = std::stod(value); break;
+            case Parameter::interaction_skin: config.interaction_skin = std::stod(value); break;
+            case Parameter::density_neighbors: config.density_neighbors = std::clamp(std::stoi(value), 0, 64); break;
+            case Parameter::density_every:  config.density_every  = std::max(std::stoi(value), 1); break;
+            case Parameter::density_color:  config.density_color  = IgnoreCase()(value, "true") || (value == "1"); break;
+            case Parameter::adaptive_softening: config.adaptive_softening = std::stod(value); break;
+            case Parameter::engine:
+                config.engine = IgnoreCase()(value, "kdtree") ? Engine::kdtree : Engine::quadtree;
+                break;
+            case Parameter::precision:
+                config.precision = IgnoreCase()(value, "float") ? Precision::float32 : Precision::float64;
+                break;
             case Parameter::speed:          config.speed          = std::stod(value); break;
+            case Parameter::halo_mass:      config.halo_mass      = std::stod(value); break;
+            case Parameter::halo_radius:    config.halo_radius    = std::stod(value); break;
+            case Parameter::halo_speed:     config.halo_speed     = std::stod(value); break;
+            case Parameter::central_mass:   config.central_mass   = std::stod(value); break;
+            case Parameter::halo:
+                if (IgnoreCase()(value, "nfw"))
+                    config.halo = Halo::nfw;
+                else if (IgnoreCase()(value, "isothermal"))
+                    config.halo = Halo::isothermal;
+                else if (IgnoreCase()(value, "logarithmic"))
+                    config.halo = Halo::logarithmic;
+                else
+                    config.halo = Halo::none;
+                break;
             case Parameter::min_fps:        config.min_fps        = std::stod(value); break;
+            case Parameter::merge_radius:   config.merge_radius   = std::stod(value); break;
+            case Parameter::merge_every:    config.merge_every    = std::max(std::stoi(value), 1); break;
+            case Parameter::refine_radius:  config.refine_radius  = std::stod(value); break;
+            case Parameter::coarse_radius:  config.coarse_radius  = std::stod(value); break;
+            case Parameter::coarse_mass:    config.coarse_mass    = std::stod(value); break;
+            case Parameter::rebalance_every: config.rebalance_every = std::max(std::stoi(value), 1); break;
+            case Parameter::box_size:       config.box_size       = std::stod(value); break;
+            case Parameter::spawn_stars:    config.spawn_stars    = std::stoi(value); break;
+            case Parameter::escape_radius:  config.escape_radius  = std::stod(value); break;
+            case Parameter::escapers:
+                if (IgnoreCase()(value, "keep"))
+                    config.escapers = Escapers::keep;
+                else if (IgnoreCase()(value, "remove"))
+                    config.escapers = Escapers::remove;
+                else
+                    config.escapers = Escapers::off;
+                break;
             case Parameter::max_fps:        config.max_fps        = std::stod(value); break;
             case Parameter::default_zoom:   config.default_zoom   = std::stod(value); break;
             case Parameter::msaa:           config.msaa           = std::stoi(value); break;
+            case Parameter::render_thread:  config.render_thread  = IgnoreCase()(value, "true") || (value == "1"); break;
+            case Parameter::field_resolution: config.field_resolution = std::max(std::stoi(value), 1); break;
+            case Parameter::field_every:    config.field_every    = std::max(std::stoi(value), 1); break;
+            case Parameter::field_smoothing: config.field_smoothing = std::stod(value); break;
+            case Parameter::field:
+                if (IgnoreCase()(value, "potential"))
+                    config.field = Field::potential;
+                else if (IgnoreCase()(value, "density"))
+                    config.field = Field::density;
+                else
+                    config.field = Field::off;
+                break;
             case Parameter::show_status:    config.show_status    = IgnoreCase()(value, "true") || (value == "1"); break;
             case Parameter::font:           config.font           = value; break;
             case Parameter::text_size:      config.text_size      = std::stoi(value); break;
-            case Parameter::text_color:
+            case Parameter::shm_export:     config.shm_export     = value; break;
+            case Parameter::trajectory_file: config.trajectory_file = value; break;
+            case Parameter::trajectory_frames: config.trajectory_frames = std::max(std::stoi(value), 0); break;
+            case Parameter::fof_length:     config.fof_length     = std::stod(value); break;
+            case Parameter::fof_every:      config.fof_every      = std::max(std::stoi(value), 1); break;
+            case Parameter::fof_min_stars:  config.fof_min_stars  = std::stoi(value); break;
+            case Parameter::fof_catalog:    config.fof_catalog    = value; break;
+            case Parameter::analysis_every: config.analysis_every = std::stoi(value); break;
+            case Parameter::analysis_bins:  config.analysis_bins  = std::max(std::stoi(value), 1); break;
+            case Parameter::analysis_radius: config.analysis_radius = std::stod(value); break;
+            case Parameter::analysis_modes: config.analysis_modes = std::max(std::stoi(value), 0); break;
+            case Parameter::analysis_output: config.analysis_output = value; break;
+            case Parameter::analysis_stats: {
+                config.analysis_stats = 0;
+                std::string stat;
+                std::stringstream strstr(value);
+                while (strstr >> stat) {
+                    if (IgnoreCase()(stat, "profile"))
+                        config.analysis_stats |= analyze_profile;
+                    else if (IgnoreCase()(stat, "rotation"))
+                        config.analysis_stats |= analyze_rotation;
+                    else if (IgnoreCase()(stat, "dispersion"))
+                        config.analysis_stats |= analyze_dispersion;
+                    else if (IgnoreCase()(stat, "modes"))
+                        config.analysis_stats |= analyze_modes;
+                }
+                break;
+            }
+            case Parameter::net_host:       config.net_host       = value; break;
+            case Parameter::net_port:       config.net_port       = std::stoi(value); break;
+            case Parameter::net_fps:        config.net_fps        = std::stod(value); break;
+            case Parameter::net_mode:
+                if (IgnoreCase()(value, "server"))
+                    config.net_mode = NetMode::server;
+                else if (IgnoreCase()(value, "viewer"))
+                    config.net_mode = NetMode::viewer;
+                else
+                    config.net_mode = NetMode::off;
+                break;
+            case Parameter::huge_pages:
+                if (IgnoreCase()(value, "explicit"))
+                    config.huge_pages = HugePages::reserved;
+                else if (IgnoreCase()(value, "transparent"))
+                    config.huge_pages = HugePages::transparent;
+                else
+                    config.huge_pages = HugePages::off;
+                break;
+            case Parameter::memory_budget:  config.memory_budget  = std::max(std::stod(value), 0.0); break;
+            case Parameter::species: {
+                Species species;
+                std::string visible;
+                std::stringstream strstr(value);
+                strstr >> species.name >> species.count >> species.mass_min >> species.mass_max
+                       >> species.softening >> visible;
+                species.visible = IgnoreCase()(visible, "true") || (visible == "1");
+                if (strstr && species.count > 0)
+                    config.species.push_back(species);
+                break;
+            }
+            case Parameter::text_color: {
                 std::stringstream strstr(value);
                 strstr >> config.text_color[0] >> config.text_color[1] >> config.text_color[2] >> config.text_color[3];
                 break;
             }
+            case Parameter::tracer_color: {
+                std::stringstream strstr(value);
+                strstr >> config.tracer_color[0] >> config.tracer_color[1] >> config.tracer_color[2];
+                break;
+            }
+            }
         } catch (const std::out_of_range&) {
             // Do nothing.
         }
     }
+
+    // Stars between the radii are left alone; without the gap, rebalancing would merge and split the same stars every pass
+    if (config.refine_radius > 0 && config.refine_radius >= config.coarse_radius) {
+        fprintf(stderr, "RefineRadius %g must be below CoarseRadius %g, using %g\n",
+                config.refine_radius, config.coarse_radius, config.coarse_radius / 2);
+        config.refine_radius = config.coarse_radius / 2;
+    }
+}
+
+int Config::initial_stars() const
+{
+    if (species.empty())
+        return stars;
+    int count = 0;
+    for (const Species& s : species)
+        count += s.count;
+    return count;
 }
 
 
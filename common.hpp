@@ -3,13 +3,8 @@
 
 #include <string>
 #include <unordered_map>
-#include "linmath.h"
-
-struct vecd2
-{
-    double x;
-    double y;
-};
+#include <vector>
+#include "vecmath.hpp"
 
 class Config
 {
@@ -17,20 +12,69 @@ private:
     enum class Parameter
     {
         stars,
+        species,
+        tracers,
         galaxy_density,
         star_speed,
         gravity,
         epsilon,
         accuracy,
+        engine,
+        precision,
+        interaction_skin,
+        density_neighbors,
+        density_every,
+        density_color,
+        adaptive_softening,
         speed,
+        halo,
+        halo_mass,
+        halo_radius,
+        halo_speed,
+        central_mass,
         min_fps,
+        merge_radius,
+        merge_every,
+        escapers,
+        spawn_stars,
+        box_size,
+        refine_radius,
+        coarse_radius,
+        coarse_mass,
+        rebalance_every,
+        escape_radius,
         max_fps,
         default_zoom,
         msaa,
+        render_thread,
+        field,
+        field_resolution,
+        field_every,
+        field_smoothing,
         show_status,
         font,
         text_size,
         text_color,
+        tracer_color,
+        shm_export,
+        trajectory_file,
+        trajectory_frames,
+        fof_length,
+        fof_every,
+        fof_min_stars,
+        fof_catalog,
+        analysis_every,
+        analysis_stats,
+        analysis_bins,
+        analysis_radius,
+        analysis_modes,
+        analysis_output,
+        net_mode,
+        net_host,
+        net_port,
+        net_fps,
+        huge_pages,
+        memory_budget,
     };
 
     // Hashing and comparing std::string ignoring case
@@ -56,52 +100,258 @@ private:
 
     inline static const std::unordered_map<std::string, Parameter, IgnoreCase, IgnoreCase> parameter_names = {
             {"Stars", Parameter::stars},
+            {"Species", Parameter::species},
+            {"Tracers", Parameter::tracers},
             {"GalaxyDens", Parameter::galaxy_density},
             {"StarSpeed", Parameter::star_speed},
             {"Gravity", Parameter::gravity},
             {"Epsilon", Parameter::epsilon},
             {"Accuracy", Parameter::accuracy},
+            {"Engine", Parameter::engine},
+            {"Precision", Parameter::precision},
+            {"InteractionSkin", Parameter::interaction_skin},
+            {"DensityNeighbors", Parameter::density_neighbors},
+            {"DensityEvery", Parameter::density_every},
+            {"DensityColor", Parameter::density_color},
+            {"AdaptiveSoftening", Parameter::adaptive_softening},
             {"Speed", Parameter::speed},
+            {"Halo", Parameter::halo},
+            {"HaloMass", Parameter::halo_mass},
+            {"HaloRadius", Parameter::halo_radius},
+            {"HaloSpeed", Parameter::halo_speed},
+            {"CentralMass", Parameter::central_mass},
             {"MinFPS", Parameter::min_fps},
+            {"MergeRadius", Parameter::merge_radius},
+            {"MergeEvery", Parameter::merge_every},
+            {"Escapers", Parameter::escapers},
+            {"SpawnStars", Parameter::spawn_stars},
+            {"BoxSize", Parameter::box_size},
+            {"RefineRadius", Parameter::refine_radius},
+            {"CoarseRadius", Parameter::coarse_radius},
+            {"CoarseMass", Parameter::coarse_mass},
+            {"RebalanceEvery", Parameter::rebalance_every},
+            {"EscapeRadius", Parameter::escape_radius},
             {"MaxFPS", Parameter::max_fps},
             {"DefaultZoom", Parameter::default_zoom},
             {"MSAA", Parameter::msaa},
+            {"RenderThread", Parameter::render_thread},
+            {"Field", Parameter::field},
+            {"FieldResolution", Parameter::field_resolution},
+            {"FieldEvery", Parameter::field_every},
+            {"FieldSmoothing", Parameter::field_smoothing},
             {"ShowStatus", Parameter::show_status},
             {"Font", Parameter::font},
             {"TextSize", Parameter::text_size},
             {"TextColor", Parameter::text_color},
+            {"TracerColor", Parameter::tracer_color},
+            {"ShmExport", Parameter::shm_export},
+            {"TrajectoryFile", Parameter::trajectory_file},
+            {"TrajectoryFrames", Parameter::trajectory_frames},
+            {"FoFLength", Parameter::fof_length},
+            {"FoFEvery", Parameter::fof_every},
+            {"FoFMinStars", Parameter::fof_min_stars},
+            {"FoFCatalog", Parameter::fof_catalog},
+            {"AnalysisEvery", Parameter::analysis_every},
+            {"AnalysisStats", Parameter::analysis_stats},
+            {"AnalysisBins", Parameter::analysis_bins},
+            {"AnalysisRadius", Parameter::analysis_radius},
+            {"AnalysisModes", Parameter::analysis_modes},
+            {"AnalysisOutput", Parameter::analysis_output},
+            {"NetMode", Parameter::net_mode},
+            {"NetHost", Parameter::net_host},
+            {"NetPort", Parameter::net_port},
+            {"NetFPS", Parameter::net_fps},
+            {"HugePages", Parameter::huge_pages},
+            {"MemoryBudget", Parameter::memory_budget},
     };
 
 public:
+    // A kind of particles
+    struct Species
+    {
+        std::string name;
+        int count;
+        double mass_min;
+        double mass_max;
+        double softening;  // same as epsilon
+        bool visible;  // invisible ones only contribute to gravity
+    };
+
+    // Analytic background potential
+    enum class Halo
+    {
+        none,
+        nfw,  // Navarro–Frenk–White
+        isothermal,
+        logarithmic,
+    };
+
+    enum class Engine
+    {
+        quadtree,  // split at geometric centers
+        kdtree,  // split at star medians
+    };
+
+    // Arithmetic of the force kernels; positions and speeds stay double
+    enum class Precision
+    {
+        float64,
+        float32,
+    };
+
+    // What to do with stars leaving the galaxy
+    enum class Escapers
+    {
+        off,
+        keep,  // move to a far-field list outside the tree
+        remove,
+    };
+
+    // Background of the view
+    enum class Field
+    {
+        off,
+        potential,
+        density,  // surface density, on a log scale
+    };
+
+    // In-situ analysis reductions, combined as flags
+    enum AnalysisStat
+    {
+        analyze_profile = 1,  // star count and surface density
+        analyze_rotation = 2,  // mean tangential speed
+        analyze_dispersion = 4,  // radial and tangential speed dispersions
+        analyze_modes = 8,  // azimuthal Fourier amplitudes
+    };
+
+    // Pages of the hot per-star arrays
+    enum class HugePages
+    {
+        off,  // small pages, from the heap
+        transparent,  // 2 MB pages when the kernel has some, madvise()
+        reserved,  // 2 MB pages from vm.nr_hugepages, MAP_HUGETLB
+    };
+
+    enum class NetMode
+    {
+        off,
+        server,  // headless simulation streaming to viewers
+        viewer,  // rendering a server's stream
+    };
+
     void load(const std::string& filename);
+    int initial_stars() const;  // of all the species
 
     std::string filename = "constel.conf";
     int stars = 7000;
+    std::vector<Species> species;  // overrides stars if not empty
+    int tracers = 0;  // massless particles showing the flow
     double galaxy_density = 10;
     double star_speed = 1.4;  // star starting speed factor
     double gravity = 0.002;
     double epsilon = 2;  // minimum effective distance
     double accuracy = 0.7;  // minimum effective distance
+    Engine engine = Engine::quadtree;
+    Precision precision = Precision::float64;
+    double interaction_skin = 0;  // margin of the cached interaction lists, 0 to walk the tree every frame
+    int density_neighbors = 0;  // k of the k-nearest-neighbor density, 0 to disable
+    int density_every = 10;  // frames between density estimates
+    bool density_color = false;  // color stars by density instead of mass
+    double adaptive_softening = 0;  // in squared k-th neighbor distances, 0 for fixed softening
     double speed = 1;  // simulation speed factor
+    Halo halo = Halo::none;
+    double halo_mass = 0;  // NFW characteristic mass
+    double halo_radius = 10;  // scale or core radius
+    double halo_speed = 1;  // asymptotic circular speed of isothermal and logarithmic halos
+    double central_mass = 0;  // point mass at the origin
     double min_fps = 40;  // maximum simulation frame = 1/FPS
+    double merge_radius = 0;  // stars closer than that merge, 0 to disable
+    int merge_every = 1;  // frames between merging passes
+    Escapers escapers = Escapers::off;
+    double escape_radius = 0;  // from the center of mass, 0 to check the energy only
+    int spawn_stars = 1000;  // stars in a galaxy added at runtime
+    double box_size = 0;  // side of the periodic box centered at the origin, 0 for open space
+    double refine_radius = 0;  // adaptive resolution around the view center, 0 to disable
+    double coarse_radius = 20;
+    double coarse_mass = 4;  // in the species' maximum masses
+    int rebalance_every = 60;  // frames between adaptive resolution passes
     double max_fps = 60;
     double default_zoom = 25;
     int msaa = 0;  // anti-aliasing samples
+    bool render_thread = true;  // render on a dedicated thread
+    Field field = Field::off;
+    int field_resolution = 256;  // minimum samples across the view
+    int field_every = 10;  // frames between updates of a field tile
+    double field_smoothing = 1;  // density kernel radius
     bool show_status = true;
     std::string font = "/usr/share/fonts/TTF/DejaVuSansMono.ttf";
     double text_size = 14;
-    vec4 text_color = { 0, 1, 0, 1 };
+    float4 text_color = { 0, 1, 0, 1 };
+    float3 tracer_color = { 0.3, 0.5, 1 };
+    std::string shm_export;  // POSIX shared memory name, disabled if empty
+    std::string trajectory_file;  // positions saved or compared after a fixed run, disabled if empty
+    int trajectory_frames = 600;
+    double fof_length = 0;  // friends-of-friends linking length, 0 to disable
+    int fof_every = 60;  // frames between group catalogs
+    int fof_min_stars = 10;
+    std::string fof_catalog = "groups.txt";
+    int analysis_every = 0;  // frames between in-situ analyses, 0 to disable
+    unsigned analysis_stats = analyze_profile | analyze_rotation | analyze_dispersion | analyze_modes;
+    int analysis_bins = 20;  // radial bins
+    double analysis_radius = 30;  // of the outermost bin
+    int analysis_modes = 4;  // highest Fourier mode
+    std::string analysis_output = "analysis.txt";
+    NetMode net_mode = NetMode::off;
+    std::string net_host = "127.0.0.1";
+    int net_port = 7457;
+    double net_fps = 30;  // frames sent to viewers per second
+    HugePages huge_pages = HugePages::transparent;
+    double memory_budget = 0;  // MB for the world and the graphics, 0 for no limit
 };
 
 extern Config config;
 
-extern vec2* disp_star_position;
-extern vec3* disp_star_color;
+extern int disp_stars;
+extern int disp_star_capacity;  // allocated in disp_star_position and disp_star_color
+extern float2* disp_star_position;
+extern float3* disp_star_color;
+extern int disp_star_color_version;  // changes whenever the displayed star set does
+extern int disp_star_recolor_version;  // changes when only the colors do
+extern int disp_tracers;
+extern float2* disp_tracer_position;
+
+// The star last clicked, for the status overlay
+struct picked_star
+{
+    int index;  // -1 for none
+    double mass;
+    double2 position;
+    double2 speed;
+};
+
+extern picked_star disp_picked;
+
+// A scalar field sampled over a world rectangle
+struct field_image
+{
+    float* values;  // 0..1, row by row from the bottom left
+    int width;
+    int height;
+    float xmin;
+    float ymin;
+    float xmax;
+    float ymax;
+    int version;  // changes with every update
+};
+
+extern field_image disp_field;
+
 extern double perf_build;
 extern double perf_accel;
 extern double perf_draw;
 
 std::string read_file(const std::string& filename);
+double get_time();
 double frame_sleep();
 float get_fps(size_t frame);
 float get_fps_period(float period);
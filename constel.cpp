@@ -1,18 +1,37 @@
 #include <memory>
 #include <string>
 
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <GLFW/glfw3.h>
 
+#include "analysis.hpp"
 #include "common.hpp"
+#include "export.hpp"
+#include "field.hpp"
 #include "graphics.hpp"
 #include "input.hpp"
+#include "memory.hpp"
+#include "net.hpp"
 #include "world.hpp"
 
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signal)
+{
+    stop_requested = 1;
+}
+
 void exit_finalize(int code)
 {
+    print_memory_usage();
+    finalize_net();
     finalize_graphics();
+    finalize_analysis();
+    finalize_field();
+    finalize_export();
     finalize_world();
     exit(code);
 }
@@ -26,7 +45,43 @@ int main(int argc, char **argv)
     if (argc >= 2)
         config_file = argv[1];
     config.load(config_file);
-    init_world();
+    if (!config.trajectory_file.empty())
+        srand(1);  // the same stars in every build
+    if (config.net_mode != Config::NetMode::viewer) {
+        size_t needed = estimate_world_memory(config.initial_stars());
+        if (config.net_mode != Config::NetMode::server)
+            needed += estimate_graphics_memory(config.initial_stars());
+        if (!check_memory_budget(needed, "The stars"))
+            exit(1);
+        init_world();
+        init_export();
+        init_analysis();
+    }
+
+    // Fixed run for comparing builds
+    if (!config.trajectory_file.empty() && config.net_mode != Config::NetMode::viewer) {
+        for (int frame = 0; frame < config.trajectory_frames; frame++)
+            world_frame(1 / config.max_fps);
+        exit_finalize(report_trajectory() ? 0 : 1);
+    }
+
+    if (!init_net())  // a viewer gets the star count from the server
+        exit_finalize(1);
+
+    // Headless main loop
+    if (config.net_mode == Config::NetMode::server) {
+        signal(SIGINT, request_stop);
+        signal(SIGTERM, request_stop);
+        while (!stop_requested) {
+            double time = frame_sleep();
+            world_frame(time);
+            export_frame();
+            analysis_frame();
+            net_frame();
+        }
+        exit_finalize(0);
+    }
+
     GLFWwindow* window = init_graphics();
     if (!window)
         exit_finalize(1);
@@ -36,7 +91,27 @@ int main(int argc, char **argv)
     while (!glfwWindowShouldClose(window)) {
         double time = frame_sleep();
         input.frame();
-        world_frame(time);
+        if (config.net_mode == Config::NetMode::viewer) {
+            if (!net_frame())
+                break;
+        } else {
+            if (input.right_click) {
+                double x, y;
+                get_cursor_position(&x, &y);
+                spawn_galaxy(x, y);
+            }
+            if (input.click) {
+                double x, y;
+                get_cursor_position(&x, &y);
+                pick_star(x, y);
+            }
+            view_rect view = get_view_rect();
+            set_focus((view.xmin + view.xmax) / 2, (view.ymin + view.ymax) / 2);
+            world_frame(time);
+            field_frame(view.xmin, view.ymin, view.xmax, view.ymax);
+            export_frame();
+            analysis_frame();
+        }
         draw();
     }
 
@@ -0,0 +1,205 @@
+// ****************************************************************************
+// Publishing star state to POSIX shared memory for external analysis tools,
+// friends-of-friends group catalogs to a text file, and trajectories to
+// compare builds with.
+// See export.hpp for the segment layout and the reading protocol.
+// ****************************************************************************
+
+#include "export.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+#include "common.hpp"
+#include "world.hpp"
+
+enum export_array { array_x, array_y, array_vx, array_vy, array_mass, array_count };
+
+static shm_export_header* header = NULL;
+static size_t segment_size = 0;
+static uint64_t frame = 0;
+static FILE* catalog = NULL;
+static int catalogs_written = 0;
+static bool truncated = false;  // already told that stars don't fit
+
+void finalize_export()
+{
+    if (catalog) {
+        fclose(catalog);
+        catalog = NULL;
+    }
+    if (header) {
+        munmap(header, segment_size);
+        shm_unlink(config.shm_export.c_str());
+        header = NULL;
+        truncated = false;
+    }
+}
+
+void init_export()
+{
+    if (config.fof_length > 0 && !config.fof_catalog.empty()) {
+        catalog = fopen(config.fof_catalog.c_str(), "a");
+        if (!catalog)
+            fprintf(stderr, "Cannot open '%s': %s\n", config.fof_catalog.c_str(), strerror(errno));
+    }
+
+    if (config.shm_export.empty())
+        return;
+
+    const size_t align = 64;  // cache line
+    size_t buffer_size = sizeof(shm_export_buffer) + array_count * config.stars * sizeof(double);
+    buffer_size = (buffer_size + align - 1) / align * align;
+    size_t buffer_offset = (sizeof(shm_export_header) + align - 1) / align * align;
+    segment_size = buffer_offset + 2 * buffer_size;
+
+    int fd = shm_open(config.shm_export.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open shared memory '%s': %s\n", config.shm_export.c_str(), strerror(errno));
+        return;
+    }
+    if (ftruncate(fd, segment_size)) {
+        fprintf(stderr, "Cannot resize shared memory '%s': %s\n", config.shm_export.c_str(), strerror(errno));
+        close(fd);
+        shm_unlink(config.shm_export.c_str());
+        return;
+    }
+    void* segment = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping stays valid
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "Cannot map shared memory '%s': %s\n", config.shm_export.c_str(), strerror(errno));
+        shm_unlink(config.shm_export.c_str());
+        return;
+    }
+
+    header = (shm_export_header*)segment;
+    header->magic = 0;  // invalid until the header is complete
+    header->version = SHM_EXPORT_VERSION;
+    header->arrays = array_count;
+    header->capacity = config.stars;
+    header->buffer_offset = buffer_offset;
+    header->buffer_size = buffer_size;
+    for (int i = 0; i < 2; i++)
+        shm_export_buffer_at(header, i)->sequence.store(0, std::memory_order_relaxed);
+    frame = 0;
+    export_frame();  // the initial state
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = SHM_EXPORT_MAGIC;
+}
+
+// Append the latest group catalog if it hasn't been written yet
+static void export_catalog()
+{
+    if (!catalog || catalogs_written == fof_catalogs)
+        return;
+    catalogs_written = fof_catalogs;
+    fprintf(catalog, "# time %g, %zu groups\n# stars mass x y vx vy\n", world_time, fof_groups.size());
+    for (const fof_group& group : fof_groups)
+        fprintf(catalog, "%d %g %g %g %g %g\n", group.stars, group.mass,
+                group.center.x, group.center.y, group.speed.x, group.speed.y);
+    fflush(catalog);
+}
+
+// Copy the current frame into the older buffer. Never blocks on readers.
+void export_frame()
+{
+    export_catalog();
+    if (!header)
+        return;
+
+    shm_export_buffer* buffer = shm_export_buffer_at(header, frame & 1);
+    uint64_t sequence = buffer->sequence.load(std::memory_order_relaxed);
+    buffer->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    buffer->frame = frame;
+    buffer->time = world_time;
+    uint64_t total = config.stars + escapers.size();
+    buffer->stars = std::min<uint64_t>(total, header->capacity);
+    if (total > header->capacity && !truncated) {
+        fprintf(stderr, "Shared memory export holds %llu stars, the rest are left out\n", (unsigned long long)header->capacity);
+        truncated = true;
+    }
+    double* x = shm_export_array(buffer, header->capacity, array_x);
+    double* y = shm_export_array(buffer, header->capacity, array_y);
+    double* vx = shm_export_array(buffer, header->capacity, array_vx);
+    double* vy = shm_export_array(buffer, header->capacity, array_vy);
+    double* mass = shm_export_array(buffer, header->capacity, array_mass);
+    uint64_t count = std::min<uint64_t>(config.stars, buffer->stars);
+    for (uint64_t i = 0; i < count; i++) {
+        x[i] = stars[i].x;
+        y[i] = stars[i].y;
+        vx[i] = motion.vx[i];
+        vy[i] = motion.vy[i];
+        mass[i] = stars[i].mass;
+    }
+    for (uint64_t i = count; i < buffer->stars; i++) {
+        const escaper& escaper = escapers[i - count];
+        x[i] = escaper.x;
+        y[i] = escaper.y;
+        vx[i] = escaper.speed.x;
+        vy[i] = escaper.speed.y;
+        mass[i] = escaper.mass;
+    }
+
+    buffer->sequence.store(sequence + 2, std::memory_order_release);
+    header->latest.store(frame, std::memory_order_release);
+    frame++;
+}
+
+// Without the file, saves the star positions in it. With it, reports how far the
+// stars are from the saved positions, e.g. those of the double build when this is
+// the COMPACT_STARS build. Both runs need the same configuration and frames.
+bool report_trajectory()
+{
+    const char* path = config.trajectory_file.c_str();
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        file = fopen(path, "w");
+        if (!file) {
+            fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
+            return false;
+        }
+        for (int i = 0; i < config.stars; i++)
+            fprintf(file, "%.17g %.17g\n", (double)stars[i].x, (double)stars[i].y);
+        fclose(file);
+        printf("Saved %d stars after %d frames in %s\n", config.stars, config.trajectory_frames, path);
+        return true;
+    }
+
+    std::vector<double2> saved;
+    double2 position;
+    while (fscanf(file, "%lf %lf", &position.x, &position.y) == 2)
+        saved.push_back(position);
+    fclose(file);
+    if ((int)saved.size() != config.stars) {
+        fprintf(stderr, "'%s' holds %zu stars, not %d: merging, escapers or refinement went differently\n",
+                path, saved.size(), config.stars);
+        return false;
+    }
+    double largest = 0;
+    double sum_sqr = 0;
+    double xmin = INFINITY, ymin = INFINITY, xmax = -INFINITY, ymax = -INFINITY;
+    for (int i = 0; i < config.stars; i++) {
+        double2 d = (double2)stars[i] - saved[i];
+        if (config.box_size > 0)  // across the box edge
+            d -= config.box_size * double2{ round(d.x / config.box_size), round(d.y / config.box_size) };
+        double error_sqr = d.x*d.x + d.y*d.y;
+        largest = std::max(largest, error_sqr);
+        sum_sqr += error_sqr;
+        xmin = std::min(xmin, saved[i].x);
+        ymin = std::min(ymin, saved[i].y);
+        xmax = std::max(xmax, saved[i].x);
+        ymax = std::max(ymax, saved[i].y);
+    }
+    double extent = std::max(xmax - xmin, ymax - ymin);
+    double rms = config.stars ? sqrt(sum_sqr / config.stars) : 0;
+    printf("Trajectory of %d stars after %d frames: largest error %.3g, rms %.3g, extent %.3g (%.3g relative)\n",
+           config.stars, config.trajectory_frames, sqrt(largest), rms, extent, extent > 0 ? sqrt(largest) / extent : 0);
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Shared memory layout for external readers.
+//
+// The segment holds a header and two frame buffers written alternately, so
+// a reader has a whole frame to consume a buffer before it is overwritten.
+// Each buffer is guarded by a sequence lock; the writer never waits:
+//   1. latest = header->latest; buff = shm_export_buffer_at(header, latest & 1)
+//   2. seq = buff->sequence (acquire); retry if odd
+//   3. read the arrays in place
+//   4. if buff->sequence (acquire after a fence) != seq, the frame was torn; retry
+// Every array has `capacity` elements, the first `stars` of them are valid.
+// The segment is sized once for the stars at startup: stars spawned beyond
+// its capacity are left out, as growing it would move the arrays under readers.
+// Stars kept out of the simulation's tree as escapers come last.
+
+#define SHM_EXPORT_MAGIC 0x004C4554534E4F43ULL  // "CONSTEL"
+#define SHM_EXPORT_VERSION 1
+
+struct shm_export_buffer
+{
+    std::atomic<uint64_t> sequence;  // odd while being written
+    uint64_t frame;
+    double time;  // simulated time
+    uint64_t stars;
+    // followed by double x[capacity], y[capacity], vx[capacity], vy[capacity], mass[capacity]
+};
+
+struct shm_export_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t arrays;  // number of arrays in a buffer
+    uint64_t capacity;  // maximum stars in a buffer
+    uint64_t buffer_offset;  // offset of buffer #0 from the header
+    uint64_t buffer_size;  // size of a buffer including its header
+    std::atomic<uint64_t> latest;  // last complete frame, its buffer is latest & 1
+};
+
+static inline shm_export_buffer* shm_export_buffer_at(shm_export_header* header, int index)
+{
+    return (shm_export_buffer*)((char*)header + header->buffer_offset + index * header->buffer_size);
+}
+
+static inline double* shm_export_array(shm_export_buffer* buffer, uint64_t capacity, int array)
+{
+    return (double*)(buffer + 1) + array * capacity;
+}
+
+void init_export();
+void export_frame();
+void finalize_export();
+bool report_trajectory();  // saves or compares, per TrajectoryFile
+
+#endif // EXPORT_H
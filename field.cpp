@@ -0,0 +1,206 @@
+// ****************************************************************************
+// Evaluating the gravitational potential or the surface density of the stars
+// on a grid through the Barnes–Hut tree, for rendering under the stars.
+// ****************************************************************************
+
+#include "field.hpp"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+#include "common.hpp"
+#include "memory.hpp"
+#include "query.hpp"
+#include "world.hpp"
+
+static const int field_tile_size = 16;
+
+struct field_tile
+{
+    int64_t x;  // in tiles
+    int64_t y;
+    long frame;  // when computed
+    double values[field_tile_size * field_tile_size];  // row by row from the bottom left
+};
+
+static std::unordered_map<uint64_t, field_tile, std::hash<uint64_t>, std::equal_to<uint64_t>,
+        tracked_allocator<std::pair<const uint64_t, field_tile>, memory_analysis>> tiles;
+static std::vector<field_tile*> pending;  // to compute this frame
+typedef std::vector<const node*> source_list;
+
+static std::vector<source_list> tile_sources;  // per thread
+static double step = 0;  // between samples
+static long frame = 0;
+static int disp_field_capacity = 0;
+
+static inline uint64_t tile_key(int64_t x, int64_t y)
+{
+    return (uint64_t)x << 32 ^ (uint32_t)y;
+}
+
+// Nodes far enough from the whole tile as they are, the others opened, as in get_accel()
+static void collect_far(const quad* node, double xmin, double ymin, double xmax, double ymax,
+        source_list& sources)
+{
+    double dx = fmax(fmax(xmin - node->x, node->x - xmax), 0);
+    double dy = fmax(fmax(ymin - node->y, node->y - ymax), 0);
+    if (!node->size || sqrt(dx*dx + dy*dy) > node->size * config.accuracy) {
+        sources.push_back(node);
+        return;
+    }
+    for (const quad* child : node->children)
+        if (child)
+            collect_far(child, xmin, ymin, xmax, ymax, sources);
+}
+
+// Potential of m / (d² + ε) forces, zero at infinity, in units of G. [softening]
+// is the source's, as a star's pair with it would take at least that. In a
+// periodic box the nodes are summed as they are, without images or the Ewald
+// correction, so the map shows the local wells but not the box's potential.
+static inline double potential(double mass, double distance_sqr, double softening)
+{
+    if (softening <= 0)
+        return distance_sqr ? -mass / sqrt(distance_sqr) : 0;
+    double soft = sqrt(softening);
+    return -mass / soft * (M_PI/2 - atan(sqrt(distance_sqr) / soft));
+}
+
+static void compute_tiles(int thread)
+{
+    source_list& sources = tile_sources[thread];
+    double h = config.field_smoothing;
+    for (size_t t = thread; t < pending.size(); t += cores) {
+        field_tile* tile = pending[t];
+        double x0 = (tile->x * field_tile_size + 0.5) * step;  // the first sample
+        double y0 = (tile->y * field_tile_size + 0.5) * step;
+        double x1 = x0 + (field_tile_size - 1) * step;
+        double y1 = y0 + (field_tile_size - 1) * step;
+        sources.clear();
+        if (config.field == Config::Field::potential)
+            collect_far(&quads[0], x0, y0, x1, y1, sources);
+        else
+            for_each_inside(&quads[0], x0 - h, y0 - h, x1 + h, y1 + h, [&](star* star) {
+                sources.push_back(star);
+            });
+
+        for (int j = 0; j < field_tile_size; j++)
+        for (int i = 0; i < field_tile_size; i++) {
+            double x = x0 + i * step;
+            double y = y0 + j * step;
+            double value = 0;
+            if (config.field == Config::Field::potential) {
+                for (const node* source : sources) {
+                    double dx = source->x - x;
+                    double dy = source->y - y;
+                    value += potential(source->mass, dx*dx + dy*dy, node_softening(source));
+                }
+            } else {
+                for (const node* source : sources) {  // Epanechnikov kernel
+                    double dx = source->x - x;
+                    double dy = source->y - y;
+                    double q = (dx*dx + dy*dy) / (h*h);
+                    if (q < 1)
+                        value += source->mass * (1 - q);
+                }
+                value *= 2 / (M_PI * h*h);
+            }
+            tile->values[i + j * field_tile_size] = value;
+        }
+    }
+}
+
+void field_frame(double xmin, double ymin, double xmax, double ymax)
+{
+    if (config.field == Config::Field::off || xmax <= xmin || ymax <= ymin)
+        return;
+    if ((int)tile_sources.size() < cores)
+        tile_sources.resize(cores);
+
+    double new_step = exp2(ceil(log2((xmax - xmin) / config.field_resolution)));
+    if (new_step != step) {
+        step = new_step;
+        tiles.clear();
+    }
+    double tile_width = field_tile_size * step;
+    int64_t tx0 = (int64_t)floor(xmin / tile_width);
+    int64_t ty0 = (int64_t)floor(ymin / tile_width);
+    int64_t tx1 = (int64_t)floor(xmax / tile_width);
+    int64_t ty1 = (int64_t)floor(ymax / tile_width);
+
+    // Forget tiles out of view, compute the new and the outdated ones
+    for (auto i = tiles.begin(); i != tiles.end(); )
+        if (i->second.x < tx0 || i->second.x > tx1 || i->second.y < ty0 || i->second.y > ty1)
+            i = tiles.erase(i);
+        else
+            ++i;
+    pending.clear();
+    for (int64_t y = ty0; y <= ty1; y++)
+    for (int64_t x = tx0; x <= tx1; x++) {
+        auto [i, added] = tiles.try_emplace(tile_key(x, y));
+        field_tile& tile = i->second;
+        if (added || frame - tile.frame >= config.field_every) {
+            tile.x = x;
+            tile.y = y;
+            tile.frame = frame;
+            if (added)  // spread the refreshes of a new view over frames
+                tile.frame -= ((x + 3*y) % config.field_every + config.field_every) % config.field_every;
+            pending.push_back(&tile);
+        }
+    }
+    float rect[4] = { (float)(tx0 * tile_width), (float)(ty0 * tile_width),
+            (float)((tx1 + 1) * tile_width), (float)((ty1 + 1) * tile_width) };
+    bool moved = disp_field.xmin != rect[0] || disp_field.ymin != rect[1] ||
+            disp_field.xmax != rect[2] || disp_field.ymax != rect[3];
+    if (!pending.empty())
+        run_pool(compute_tiles);
+    frame++;
+    if (pending.empty() && !moved)
+        return;
+
+    // Publish, normalized to 0..1, the density on a log scale
+    int width = (tx1 - tx0 + 1) * field_tile_size;
+    int height = (ty1 - ty0 + 1) * field_tile_size;
+    if (disp_field_capacity < width * height) {
+        disp_field_capacity = width * height;
+        disp_field.values = (float*)tracked_realloc(memory_display, disp_field.values, disp_field_capacity * sizeof(float));
+    }
+    double low = INFINITY;
+    double high = -INFINITY;
+    for (const auto& [key, tile] : tiles)
+        for (double value : tile.values) {
+            low = fmin(low, value);
+            high = fmax(high, value);
+        }
+    double offset = 1e-3 * high;  // keeps the log of empty space finite
+    if (config.field == Config::Field::density) {
+        low = log(low + offset);
+        high = log(high + offset);
+    }
+    for (const auto& [key, tile] : tiles)
+        for (int j = 0; j < field_tile_size; j++)
+        for (int i = 0; i < field_tile_size; i++) {
+            double value = tile.values[i + j * field_tile_size];
+            if (config.field == Config::Field::density)
+                value = log(value + offset);
+            int x = (tile.x - tx0) * field_tile_size + i;
+            int y = (tile.y - ty0) * field_tile_size + j;
+            disp_field.values[x + y * width] = high > low ? (value - low) / (high - low) : 0;
+        }
+    disp_field.width = width;
+    disp_field.height = height;
+    disp_field.xmin = rect[0];
+    disp_field.ymin = rect[1];
+    disp_field.xmax = rect[2];
+    disp_field.ymax = rect[3];
+    disp_field.version++;
+}
+
+void finalize_field()
+{
+    tiles.clear();
+    tracked_free(disp_field.values);
+    disp_field.values = NULL;
+    disp_field_capacity = 0;
+}
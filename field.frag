@@ -0,0 +1,15 @@
+#version 130
+
+uniform sampler2D texture;
+in vec2 texture_pos;
+
+// Dim enough to keep the stars in front
+const float brightness = 0.35;
+
+void main()
+{
+    float value = texture2D(texture, texture_pos).r;
+    vec3 color = mix(vec3(0.0, 0.0, 0.15), vec3(0.5, 0.0, 0.5), smoothstep(0.0, 0.5, value));
+    color = mix(color, vec3(1.0, 0.6, 0.1), smoothstep(0.5, 1.0, value));
+    gl_FragColor = vec4(brightness * color, 1.0);
+}
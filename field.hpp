@@ -0,0 +1,14 @@
+#ifndef FIELD_H
+#define FIELD_H
+
+// Potential or density field of the stars over the view, for the background.
+//
+// Samples lie on a power-of-two grid in world coordinates, in tiles of
+// field_tile_size² that share one tree walk. Tiles stay cached while the view
+// pans and are refreshed every FieldEvery frames; a zoom past a power of two
+// starts over. The result is published in disp_field.
+
+void field_frame(double xmin, double ymin, double xmax, double ymax);  // the view, after world_frame()
+void finalize_field();
+
+#endif // FIELD_H
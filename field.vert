@@ -0,0 +1,20 @@
+#version 130
+
+// Field quad
+const vec2 corners[] = vec2[](
+    vec2(0, 0),
+    vec2(0, 1),
+    vec2(1, 0),
+    vec2(1, 1)
+);
+
+uniform mat4 projection;
+uniform vec4 rect;  // xmin, ymin, xmax, ymax
+out vec2 texture_pos;
+
+void main()
+{
+    vec2 corner = corners[gl_VertexID];
+    gl_Position = projection * vec4(mix(rect.xy, rect.zw, corner), 0, 1);
+    texture_pos = corner;
+}
@@ -11,14 +11,20 @@
 #include <GL/glew.h>
 #include <GL/gl.h>
 #include <GLFW/glfw3.h>
+#include <thread>
 #include "common.hpp"
+#include "graphics.hpp"
 #include "input.hpp"
-#include "linmath.h"
+#include "memory.hpp"
+#include "vecmath.hpp"
+#include "lockfree.hpp"
 
 #define ZOOM_SENSITIVITY 1.2
 
 static int win_width = 1024; // actual size of the client area
 static int win_height = 1024;
+static int view_width = 1024;  // the client area as last seen by the renderer
+static int view_height = 1024;
 
 
 
@@ -31,11 +37,13 @@ static GLint text_texture_uniform;
 static GLint text_color_uniform;
 static GLint text_projection_uniform;
 static GLint text_pos_uniform;
-static mat4x4 text_projection;
+static float4x4 text_projection;
 static GLuint text_vbo = GL_INVALID_VALUE;
 static FT_Library freetype;
 static char* text_buff = NULL;
 static size_t text_buff_length = 1024;
+static size_t text_vbo_bytes = 0;  // as counted in memory_gl
+static size_t font_texture_bytes = 0;
 
 enum align
 {
@@ -79,11 +87,12 @@ static struct font
 static struct font* new_font(const char* font_path, int size)
 {
     const int texture_max_width = 1024;
-    struct font* font = (struct font*)calloc(1, sizeof(struct font));
+    struct font* font = (struct font*)tracked_realloc(memory_text, NULL, sizeof(struct font));
+    memset(font, 0, sizeof(struct font));
     FT_Face face;
     if (FT_New_Face(freetype, font_path, 0, &face)) {
         fprintf(stderr, "Cannot open font '%s'\n", font_path);
-        free(font);
+        tracked_free(font);
         return NULL;
     }
 
@@ -119,6 +128,7 @@ static struct font* new_font(const char* font_path, int size)
     glGenTextures(1, &font->texture);
     glBindTexture(GL_TEXTURE_2D, font->texture);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, font->texture_width, font->texture_height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, 0);
+    count_memory(memory_gl, &font_texture_bytes, font->texture_width * font->texture_height);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -165,14 +175,14 @@ static void draw_text(struct font* font, int x, int y, enum align align, const c
         va_end(argptr);
         if (length >= text_buff_length) {
             text_buff_length = 2 * length;
-            text_buff = (char*)realloc(text_buff, text_buff_length);
+            text_buff = (char*)tracked_realloc(memory_text, text_buff, text_buff_length);
             continue;
         }
     } while (false);
     if (length < 0)
         return;
 
-    vec2 text_pos = { x, win_height - y - font->height };
+    float2 text_pos = { x, view_height - y - font->height };
     y = 0;
     struct font_point coords[6*length];
     struct font_point* coord = coords;
@@ -213,17 +223,18 @@ static void draw_text(struct font* font, int x, int y, enum align align, const c
     }
 
     if (align & align_bottom)
-        text_pos[1] -= y;  // y is negative
+        text_pos.y -= y;  // y is negative
     int n = coord - coords;  // total number of printable characters
 
     glBindTexture(GL_TEXTURE_2D, font->texture);
     glUseProgram(text_shader);
     glUniform1i(text_texture_uniform, 0);
-    glUniform2fv(text_pos_uniform, 1, text_pos);
+    glUniform2fv(text_pos_uniform, 1, text_pos.data());
     glEnableVertexAttribArray(text_char_pos_attrib);
     glVertexAttribPointer(text_char_pos_attrib, 4, GL_FLOAT, GL_FALSE, 0, 0);
     glBindBuffer(GL_ARRAY_BUFFER, text_vbo);
     glBufferData(GL_ARRAY_BUFFER, sizeof(coords), coords, GL_DYNAMIC_DRAW);
+    count_memory(memory_gl, &text_vbo_bytes, sizeof(coords));
     glDrawArrays(GL_TRIANGLES, 0, n);
     glDisableVertexAttribArray(text_char_pos_attrib);
 }
@@ -242,6 +253,8 @@ static int restored_y;
 static int restored_width = 1024;
 static int restored_height = 1024;
 static bool need_update_view = true;
+static hot_memory_stats memory_stats = { 0, 0, 0 };
+static double memory_stats_time = -INFINITY;
 
 // Dealing with window state changes
 static void update_window()
@@ -304,21 +317,91 @@ static void glfw_resize(GLFWwindow* window, int width, int height)
 ///////////////////////////////////////////////////////////////////////////////
 // ============================= General graphics =============================
 
-static vec2 view_center = { 0, 0 };
+static float2 view_center = { 0, 0 };
 static float zoom;
 
+// Everything the renderer needs from the window and the input
+struct view_input
+{
+    int panx;
+    int pany;
+    double scroll;
+    double mousex;  // cursor position in pixels
+    double mousey;
+    int width;  // client area
+    int height;
+    bool resized;
+};
+
+// Frame handed to the renderer
+struct render_frame
+{
+    int stars;
+    float2* star_position;
+    float3* star_color;
+    int star_color_version;
+    float2* tracer_position;
+    float fps;
+    int position_capacity;  // allocated in star_position
+    int color_capacity;  // allocated in star_color
+    field_image field;
+    int field_capacity;  // allocated in field.values
+    hot_memory_stats memory;
+    picked_star picked;
+};
+
+// Changes with the star set or its colors; both counters only grow
+static int star_colors_version()
+{
+    return disp_star_color_version + disp_star_recolor_version;
+}
+
+// Render thread
+static std::thread renderer;
+static std::atomic<bool> renderer_stop;
+static TripleBuffer<render_frame> render_frames;  // simulation -> renderer
+static SpscQueue<view_input, 64> view_inputs;  // window -> renderer
+static TripleBuffer<view_rect> view_rects;  // renderer -> simulation
+static view_input pending_input = { 0 };  // not queued yet
+static void render_loop();
+
+// World coordinates of the client area, as rendered
+static view_rect get_render_rect()
+{
+    return {
+        -0.5f*view_width/zoom + view_center.x,
+        -0.5f*view_height/zoom + view_center.y,
+         0.5f*view_width/zoom + view_center.x,
+         0.5f*view_height/zoom + view_center.y,
+    };
+}
+
 static GLuint star_texture = GL_INVALID_VALUE;
 static float* star_texture_values = NULL;
 static int star_texture_buff_size = 0;
+static size_t star_texture_bytes = 0;  // as counted in memory_gl
 
 static GLuint star_shader = GL_INVALID_VALUE;
-static mat4x4 projection;
+static float4x4 projection;
 static GLint star_projection_uniform = GL_INVALID_VALUE;
 static GLint star_texture_uniform = GL_INVALID_VALUE;
 static GLint star_position_attribute = GL_INVALID_VALUE;
 static GLint star_color_attribute = GL_INVALID_VALUE;
 static GLuint star_position_vbo = GL_INVALID_VALUE;
 static GLuint star_color_vbo = GL_INVALID_VALUE;
+static GLuint tracer_position_vbo = GL_INVALID_VALUE;
+static int star_color_vbo_version = -1;  // star_colors_version() in star_color_vbo
+static int star_color_vbo_capacity = 0;  // stars allocated in star_color_vbo
+static size_t star_position_vbo_bytes = 0;  // as counted in memory_gl
+static size_t star_color_vbo_bytes = 0;
+static size_t tracer_position_vbo_bytes = 0;
+
+static GLuint field_shader = GL_INVALID_VALUE;
+static GLint field_projection_uniform = GL_INVALID_VALUE;
+static GLint field_rect_uniform = GL_INVALID_VALUE;
+static GLuint field_texture = GL_INVALID_VALUE;
+static int field_texture_version = -1;  // disp_field.version in field_texture
+static size_t field_texture_bytes = 0;  // as counted in memory_gl
 
 // Log the latest error associated with the object
 static void gl_log(GLuint object)
@@ -392,35 +475,31 @@ static GLuint make_shader_program(const char *vertex_file, const char *fragment_
 }
 
 // Recalculate client area
-static void update_view()
+static void update_view(const view_input& view)
 {
-    need_update_view = false;
-    glViewport(0, 0, win_width, win_height);
+    view_width = view.width;
+    view_height = view.height;
+    glViewport(0, 0, view_width, view_height);
 
-    view_center[0] -= input.panx / zoom;
-    view_center[1] += input.pany / zoom;
+    view_center -= float2{ (float)view.panx, (float)-view.pany } / zoom;
 
     // Update zoom
-    if (input.scroll) {
-        float new_zoom = zoom * pow(ZOOM_SENSITIVITY, input.scroll);
-        struct vecd2 mouse; // mouse position in pixels
-        glfwGetCursorPos(window, &mouse.x, &mouse.y);
-        mouse.x = mouse.x - 0.5*win_width;
-        mouse.y = 0.5*win_height - mouse.y;
+    if (view.scroll) {
+        float new_zoom = zoom * pow(ZOOM_SENSITIVITY, view.scroll);
+        double2 mouse = { view.mousex - 0.5*view_width, 0.5*view_height - view.mousey };  // in pixels
         // Preserve the world coordinate under mouse when zooming
-        view_center[0] += (float)mouse.x * (1/zoom - 1/new_zoom);
-        view_center[1] += (float)mouse.y * (1/zoom - 1/new_zoom);
+        view_center += vec_cast<float>(mouse) * (1/zoom - 1/new_zoom);
         zoom = new_zoom;
     }
 
     // Re-generate the star sprite
     glUseProgram(star_shader);
-    if ((input.scroll || !star_texture_values) && zoom < 1000) {
+    if ((view.scroll || !star_texture_values) && zoom < 1000) {
         const float star_size = 0.5;  // equals to star.vert::star_size
         int star_texture_size = 2.0f * star_size * zoom;
         if (star_texture_buff_size < star_texture_size * star_texture_size) {
             star_texture_buff_size = star_texture_size * star_texture_size;
-            star_texture_values = (float*)realloc(star_texture_values, star_texture_buff_size * sizeof(float));
+            star_texture_values = (float*)tracked_realloc(memory_sprite, star_texture_values, star_texture_buff_size * sizeof(float));
         }
 
         for (int x = 0; x < (star_texture_size+1)/2; x++)
@@ -444,29 +523,67 @@ static void update_view()
         glActiveTexture(GL_TEXTURE1);
         glBindTexture(GL_TEXTURE_2D, star_texture);
         glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, star_texture_size, star_texture_size, 0, GL_ALPHA, GL_FLOAT, star_texture_values);
+        count_memory(memory_gl, &star_texture_bytes, star_texture_size * star_texture_size * sizeof(float));
     }
 
-    mat4x4_identity(projection);
-    mat4x4_ortho(projection,
-        -0.5f*win_width/zoom + view_center[0],
-         0.5f*win_width/zoom + view_center[0],
-        -0.5f*win_height/zoom + view_center[1],
-         0.5f*win_height/zoom + view_center[1],
-        -1, 1);
-    glUniformMatrix4fv(star_projection_uniform, 1, GL_FALSE, (const GLfloat*)projection);
+    view_rect rect = get_render_rect();
+    projection = ortho(rect.xmin, rect.xmax, rect.ymin, rect.ymax, -1, 1);
+    glUniformMatrix4fv(star_projection_uniform, 1, GL_FALSE, projection.data());
+    if (field_shader != GL_INVALID_VALUE) {
+        glUseProgram(field_shader);
+        glUniformMatrix4fv(field_projection_uniform, 1, GL_FALSE, projection.data());
+    }
 
-    mat4x4_identity(text_projection);
-    mat4x4_ortho(text_projection, 0, win_width, 0, win_height, -1, 1);
+    text_projection = ortho(0, view_width, 0, view_height, -1, 1);
     glUseProgram(text_shader);
-    glUniformMatrix4fv(text_projection_uniform, 1, GL_FALSE, (const GLfloat*)text_projection);
+    glUniformMatrix4fv(text_projection_uniform, 1, GL_FALSE, text_projection.data());
+
+    if (config.render_thread) {
+        view_rects.back() = rect;
+        view_rects.publish();
+    }
+}
+
+view_rect get_view_rect()
+{
+    if (!config.render_thread)
+        return get_render_rect();
+    view_rects.acquire();
+    return view_rects.front();
 }
 
 void finalize_graphics()
 {
+    if (renderer.joinable()) {
+        renderer_stop = true;
+        renderer.join();
+        glfwMakeContextCurrent(window);
+        for (render_frame& frame : render_frames.slots) {
+            if (&frame != &render_frames.back())  // the back slot's positions belong to the world
+                tracked_free(frame.star_position);
+            if (frame.tracer_position != disp_tracer_position)
+                tracked_free(frame.tracer_position);
+            tracked_free(frame.star_color);
+            tracked_free(frame.field.values);
+            frame.star_position = NULL;
+            frame.tracer_position = NULL;
+            frame.star_color = NULL;
+            frame.field.values = NULL;
+        }
+    }
     if (star_shader != GL_INVALID_VALUE) {
         glDeleteProgram(star_shader);
         star_shader = GL_INVALID_VALUE;
     }
+    if (field_shader != GL_INVALID_VALUE) {
+        glDeleteProgram(field_shader);
+        field_shader = GL_INVALID_VALUE;
+    }
+    if (field_texture != GL_INVALID_VALUE) {
+        glDeleteTextures(1, &field_texture);
+        field_texture = GL_INVALID_VALUE;
+        count_memory(memory_gl, &field_texture_bytes, 0);
+    }
     if (text_shader != GL_INVALID_VALUE) {
         glDeleteProgram(text_shader);
         text_shader = GL_INVALID_VALUE;
@@ -474,30 +591,40 @@ void finalize_graphics()
     if (star_position_vbo != GL_INVALID_VALUE) {
         glDeleteBuffers(1, &star_position_vbo);
         star_position_vbo = GL_INVALID_VALUE;
+        count_memory(memory_gl, &star_position_vbo_bytes, 0);
     }
     if (star_color_vbo != GL_INVALID_VALUE) {
         glDeleteBuffers(1, &star_color_vbo);
         star_color_vbo = GL_INVALID_VALUE;
+        count_memory(memory_gl, &star_color_vbo_bytes, 0);
+    }
+    if (tracer_position_vbo != GL_INVALID_VALUE) {
+        glDeleteBuffers(1, &tracer_position_vbo);
+        tracer_position_vbo = GL_INVALID_VALUE;
+        count_memory(memory_gl, &tracer_position_vbo_bytes, 0);
     }
     if (text_vbo != GL_INVALID_VALUE) {
         glDeleteBuffers(1, &text_vbo);
         text_vbo = GL_INVALID_VALUE;
+        count_memory(memory_gl, &text_vbo_bytes, 0);
     }
     if (star_texture != GL_INVALID_VALUE) {
         glDeleteTextures(1, &star_texture);
         star_texture = GL_INVALID_VALUE;
+        count_memory(memory_gl, &star_texture_bytes, 0);
     }
     if (star_texture_values) {
-        free(star_texture_values);
+        tracked_free(star_texture_values);
         star_texture_values = NULL;
     }
     if (font) {
         glDeleteTextures(1, &font->texture);
-        free(font);
+        tracked_free(font);
+        count_memory(memory_gl, &font_texture_bytes, 0);
         font = NULL;
     }
     if (text_buff) {
-        free(text_buff);
+        tracked_free(text_buff);
         text_buff = NULL;
     }
     if (window) {
@@ -510,6 +637,17 @@ void finalize_graphics()
     }
 }
 
+size_t estimate_graphics_memory(int stars)
+{
+    size_t star = sizeof(float2) + 2 * sizeof(float3);  // the color VBO grows ahead
+    size_t tracer = sizeof(float2);
+    if (config.render_thread) {  // two more position slots, and a color copy in each
+        star += 2 * sizeof(float2) + 3 * sizeof(float3);
+        tracer += 2 * sizeof(float2);
+    }
+    return (size_t)stars * star + (size_t)config.tracers * tracer;
+}
+
 GLFWwindow* init_graphics()
 {
     // Init OpenGL and GLFW
@@ -555,15 +693,15 @@ GLFWwindow* init_graphics()
     star_color_attribute = glGetAttribLocation(star_shader, "star_color");
 
     glGenBuffers(1, &star_position_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, star_position_vbo);
+    glGenBuffers(1, &tracer_position_vbo);
     glVertexAttribDivisor(star_position_attribute, 1);
 
     glGenBuffers(1, &star_color_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, star_color_vbo);
     glVertexAttribDivisor(star_color_attribute, 1);
     glVertexAttribPointer(star_color_attribute, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * config.stars, disp_star_color, GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, star_color_vbo);
     glEnableVertexAttribArray(star_color_attribute);
+    star_color_vbo_version = -1;  // uploaded with the first frame
 
     glGenTextures(1, &star_texture);
     glBindTexture(GL_TEXTURE_2D, star_texture);
@@ -572,10 +710,32 @@ GLFWwindow* init_graphics()
     glUseProgram(star_shader);
     glUniform1i(star_texture_uniform, 1);
 
+    // Init the field
+    if (config.field != Config::Field::off) {
+        field_shader = make_shader_program("field.vert", "field.frag");
+        if (!field_shader) {
+            finalize_graphics();
+            return NULL;
+        }
+        field_projection_uniform = glGetUniformLocation(field_shader, "projection");
+        field_rect_uniform = glGetUniformLocation(field_shader, "rect");
+        glGenTextures(1, &field_texture);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, field_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glActiveTexture(GL_TEXTURE1);
+        glUseProgram(field_shader);
+        glUniform1i(glGetUniformLocation(field_shader, "texture"), 2);
+        field_texture_version = -1;
+    }
+
 
     // Init text
     if (config.show_status) {
-        text_buff = (char*)malloc(text_buff_length * sizeof(*text_buff));
+        text_buff = (char*)tracked_realloc(memory_text, NULL, text_buff_length * sizeof(*text_buff));
         glGenBuffers(1, &text_vbo);
         if (FT_Init_FreeType(&freetype)) {
             fputs("FT_Init_FreeType failed\n", stderr);
@@ -593,7 +753,7 @@ GLFWwindow* init_graphics()
         text_texture_uniform = glGetUniformLocation(text_shader, "texture");
         text_color_uniform = glGetUniformLocation(text_shader, "color");
         glUseProgram(text_shader);
-        glUniform4fv(text_color_uniform, 1, config.text_color);
+        glUniform4fv(text_color_uniform, 1, config.text_color.data());
         font = new_font(config.font.c_str(), config.text_size);
         if (!font) {
             finalize_graphics();
@@ -601,27 +761,102 @@ GLFWwindow* init_graphics()
         }
     }
 
+    // Hand the context over to the render thread
+    if (config.render_thread) {
+        render_frames.slots[0].star_position = disp_star_position;  // the producer's slot
+        render_frames.slots[0].tracer_position = disp_tracer_position;
+        for (int i = 1; i < 3; i++) {
+            render_frames.slots[i].star_position = (float2*)hot_realloc(memory_display, NULL, disp_star_capacity * sizeof(float2));
+            render_frames.slots[i].tracer_position = (float2*)tracked_realloc(memory_display, NULL, disp_tracers * sizeof(float2));
+        }
+        for (render_frame& frame : render_frames.slots) {
+            frame.star_color = (float3*)tracked_realloc(memory_display, NULL, disp_star_capacity * sizeof(float3));  // copied on change
+            frame.star_color_version = -1;
+            frame.picked.index = -1;
+            frame.position_capacity = disp_star_capacity;
+            frame.color_capacity = disp_star_capacity;
+        }
+        for (view_rect& rect : view_rects.slots)
+            rect = get_render_rect();
+        renderer_stop = false;
+        glfwMakeContextCurrent(NULL);
+        renderer = std::thread(render_loop);
+    }
+
     return window;
 }
 
-void draw()
+static void merge_input(view_input* into, const view_input& from)
 {
-    // Update window and client area state
-    if (input.double_click || input.f % 2 || (maximized != glfwGetWindowAttrib(window, GLFW_MAXIMIZED)))
-        update_window();
-    if (need_update_view || input.scroll || input.panx || input.pany)
-        update_view();
+    into->panx += from.panx;
+    into->pany += from.pany;
+    into->scroll += from.scroll;
+    into->mousex = from.mousex;
+    into->mousey = from.mousey;
+    into->width = from.width;
+    into->height = from.height;
+    into->resized |= from.resized;
+}
+
+// Render a frame into the back buffer
+static void render(const view_input& view, const render_frame& frame)
+{
+    if (view.resized || view.scroll || view.panx || view.pany)
+        update_view(view);
     glClear(GL_COLOR_BUFFER_BIT);
 
+    // Draw the field under the stars
+    if (field_shader != GL_INVALID_VALUE && frame.field.values) {
+        glActiveTexture(GL_TEXTURE2);
+        if (field_texture_version != frame.field.version) {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, frame.field.width, frame.field.height, 0,
+                    GL_LUMINANCE, GL_FLOAT, frame.field.values);
+            count_memory(memory_gl, &field_texture_bytes, frame.field.width * frame.field.height * sizeof(float));
+            field_texture_version = frame.field.version;
+        }
+        glActiveTexture(GL_TEXTURE1);
+        glBlendFunc(GL_ONE, GL_ZERO);
+        glUseProgram(field_shader);
+        glUniform4f(field_rect_uniform, frame.field.xmin, frame.field.ymin, frame.field.xmax, frame.field.ymax);
+        glDisableVertexAttribArray(star_position_attribute);  // instanced arrays aren't read by the quad
+        glDisableVertexAttribArray(star_color_attribute);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glEnableVertexAttribArray(star_color_attribute);
+    }
+
     // Draw stars
     // comment the next line for a more realistic and less spectacular rendering
     glBlendFunc(GL_SRC_ALPHA, GL_ONE);
     glUseProgram(star_shader);
+    glBindTexture(GL_TEXTURE_2D, star_texture);
+    if (star_color_vbo_version != frame.star_color_version) {
+        glBindBuffer(GL_ARRAY_BUFFER, star_color_vbo);
+        if (star_color_vbo_capacity < frame.stars) {  // grow ahead of the star count
+            star_color_vbo_capacity = frame.stars > 2 * star_color_vbo_capacity ? frame.stars : 2 * star_color_vbo_capacity;
+            glBufferData(GL_ARRAY_BUFFER, sizeof(float3) * star_color_vbo_capacity, NULL, GL_STATIC_DRAW);
+            count_memory(memory_gl, &star_color_vbo_bytes, sizeof(float3) * star_color_vbo_capacity);
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float3) * frame.stars, frame.star_color);
+        star_color_vbo_version = frame.star_color_version;
+    }
     glEnableVertexAttribArray(star_position_attribute);
+    glBindBuffer(GL_ARRAY_BUFFER, star_position_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float2) * frame.stars, frame.star_position, GL_STREAM_DRAW);  // orphaned every frame
+    count_memory(memory_gl, &star_position_vbo_bytes, sizeof(float2) * frame.stars);
     glVertexAttribPointer(star_position_attribute, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vec2) * config.stars, disp_star_position, GL_STREAM_DRAW);
-    glBindTexture(GL_TEXTURE_2D, star_texture);
-    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, config.stars);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, frame.stars);
+
+    // Draw tracers with a constant color
+    if (disp_tracers) {
+        glBindBuffer(GL_ARRAY_BUFFER, tracer_position_vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float2) * disp_tracers, frame.tracer_position, GL_STREAM_DRAW);
+        count_memory(memory_gl, &tracer_position_vbo_bytes, sizeof(float2) * disp_tracers);
+        glVertexAttribPointer(star_position_attribute, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+        glDisableVertexAttribArray(star_color_attribute);
+        glVertexAttrib3fv(star_color_attribute, config.tracer_color.data());
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, disp_tracers);
+        glEnableVertexAttribArray(star_color_attribute);
+    }
 
     // Draw text
     if (config.show_status) {
@@ -632,14 +867,122 @@ void draw()
             snprintf(zoom_text, sizeof(zoom_text), "%.0fx", zoom/config.default_zoom);
         else
             snprintf(zoom_text, sizeof(zoom_text), "1:%.0f", (float)config.default_zoom/zoom);
-        draw_text(font, win_width - font->chars[' '].dx, font->chars[' '].dx/2, align_top_right,
+        char picked_text[160] = "";
+        const picked_star& picked = frame.picked;
+        if (picked.index >= 0)
+            snprintf(picked_text, sizeof(picked_text), "\nStar %d: mass %.3g\nX: %.2f  Y: %.2f\nSpeed: %.3g, %.3g",
+                    picked.index, picked.mass, picked.position.x, picked.position.y, picked.speed.x, picked.speed.y);
+        draw_text(font, view_width - font->chars[' '].dx, font->chars[' '].dx/2, align_top_right,
                 "X: %.2f  Y: %.2f\n"
                 "Zoom: %s\n"
-                "%.0f FPS",
-                view_center[0], view_center[1],
+                "%.0f FPS\n"
+                "Stars: %.0f MB, %.0f%% on 2 MB pages%s",
+                view_center.x, view_center.y,
                 zoom_text,
-                get_fps_period(1)+0.5f);
+                frame.fps+0.5f,
+                frame.memory.bytes / 1048576.0,
+                frame.memory.bytes ? 100.0 * frame.memory.huge_bytes / frame.memory.bytes : 0.0,
+                picked_text);
+    }
+}
+
+// Runs on the render thread, which owns the GL context, until finalize_graphics().
+// A slow glfwSwapBuffers() only delays this loop, not input or physics.
+static void render_loop()
+{
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(1);
+    bool has_frame = false;
+    while (!renderer_stop) {
+        view_input view = { 0, 0, 0, 0, 0, view_width, view_height, false };
+        view_input item;
+        bool has_input = false;
+        while (view_inputs.pop(&item)) {
+            merge_input(&view, item);
+            has_input = true;
+        }
+        bool new_frame = render_frames.acquire();
+        has_frame |= new_frame;
+        if (!has_frame || (!new_frame && !has_input)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        render(view, render_frames.front());
+        glfwSwapBuffers(window);
+    }
+    glfwMakeContextCurrent(NULL);
+}
+
+// Runs on the main thread
+void draw()
+{
+    // Update window and client area state
+    if (input.double_click || input.f % 2 || (maximized != glfwGetWindowAttrib(window, GLFW_MAXIMIZED)))
+        update_window();
+    view_input view = { input.panx, input.pany, input.scroll, 0, 0, win_width, win_height, need_update_view };
+    glfwGetCursorPos(window, &view.mousex, &view.mousey);
+    need_update_view = false;
+    if (config.show_status && glfwGetTime() - memory_stats_time >= 1) {  // reading smaps takes a while
+        memory_stats = get_hot_memory_stats();
+        memory_stats_time = glfwGetTime();
+    }
+
+    if (!config.render_thread) {
+        render(view, { disp_stars, disp_star_position, disp_star_color, star_colors_version(),
+                disp_tracer_position, get_fps_period(1), disp_star_capacity, disp_star_capacity,
+                disp_field, disp_field.width * disp_field.height, memory_stats, disp_picked });
+        glfwSwapBuffers(window);
+        return;
     }
 
-    glfwSwapBuffers(window);
+    // Hand over to the render thread. Input it cannot take yet is kept for the next frame.
+    merge_input(&pending_input, view);
+    if (pending_input.resized || pending_input.scroll || pending_input.panx || pending_input.pany)
+        if (view_inputs.push(pending_input))
+            pending_input = { 0 };
+    render_frame& frame = render_frames.back();
+    frame.stars = disp_stars;
+    frame.star_position = disp_star_position;  // the world may have reallocated it
+    frame.position_capacity = disp_star_capacity;
+    frame.fps = get_fps_period(1);
+    frame.memory = memory_stats;
+    frame.picked = disp_picked;
+    if (frame.star_color_version != star_colors_version()) {
+        if (frame.color_capacity < disp_stars) {
+            frame.color_capacity = disp_star_capacity;
+            frame.star_color = (float3*)tracked_realloc(memory_display, frame.star_color, frame.color_capacity * sizeof(float3));
+        }
+        memcpy(frame.star_color, disp_star_color, disp_stars * sizeof(float3));
+        frame.star_color_version = star_colors_version();
+    }
+    if (frame.field.version != disp_field.version) {
+        float* values = frame.field.values;
+        if (frame.field_capacity < disp_field.width * disp_field.height) {
+            frame.field_capacity = disp_field.width * disp_field.height;
+            values = (float*)tracked_realloc(memory_display, values, frame.field_capacity * sizeof(float));
+        }
+        frame.field = disp_field;
+        frame.field.values = values;
+        memcpy(values, disp_field.values, disp_field.width * disp_field.height * sizeof(float));
+    }
+    render_frames.publish();
+
+    // The world writes the next positions into the new back slot, grown if it lags behind
+    render_frame& back = render_frames.back();
+    if (back.position_capacity < disp_star_capacity) {
+        back.position_capacity = disp_star_capacity;
+        back.star_position = (float2*)hot_realloc(memory_display, back.star_position, back.position_capacity * sizeof(float2));
+    }
+    disp_star_position = back.star_position;
+    disp_tracer_position = back.tracer_position;
+}
+
+// Cursor position in world coordinates
+void get_cursor_position(double* x, double* y)
+{
+    double mousex, mousey;
+    glfwGetCursorPos(window, &mousex, &mousey);
+    view_rect rect = get_view_rect();
+    *x = rect.xmin + mousex / win_width * (rect.xmax - rect.xmin);
+    *y = rect.ymax - mousey / win_height * (rect.ymax - rect.ymin);
 }
@@ -1,8 +1,23 @@
 #ifndef GRAPHICS_H
 #define GRAPHICS_H
 
+#include <stddef.h>
+#include <GLFW/glfw3.h>
+
+// World coordinates of the client area
+struct view_rect
+{
+    float xmin;
+    float ymin;
+    float xmax;
+    float ymax;
+};
+
 GLFWwindow* init_graphics();
 void draw();
+view_rect get_view_rect();
+void get_cursor_position(double* x, double* y);
 void finalize_graphics();
+size_t estimate_graphics_memory(int stars);  // bytes of the per-star buffers, on both sides of GL
 
 #endif // GRAPHICS_H
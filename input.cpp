@@ -51,28 +51,31 @@ void Input::glfw_mouse_button(GLFWwindow* window, int button, int action, int mo
     assert(window == input.window && "Different window");
 
     static double double_click_start = -std::numeric_limits<double>::infinity();
-    static double clickx = 0;
-    static double clicky = 0;
+    static double2 click = { 0, 0 };
 
     bool pressed = (action == GLFW_PRESS);
-    double cur_mousex, cur_mousey;
-    glfwGetCursorPos(window, &cur_mousex, &cur_mousey);
+    double2 mouse;
+    glfwGetCursorPos(window, &mouse.x, &mouse.y);
+    double2 slip = mouse - click;
+    bool still = std::abs(slip.x) <= double_click_tolerance && std::abs(slip.y) <= double_click_tolerance;
     switch(button) {
     case GLFW_MOUSE_BUTTON_LEFT:
     {
-        input.mouse_left = pressed;
-        if (!pressed)
+        if (!pressed) {
+            if (input.mouse_left && still)
+                input.click = true;
+            input.mouse_left = false;
             break;
+        }
+        input.mouse_left = true;
         double time = glfwGetTime();
-        if (time - double_click_start <= double_click_interval
-              && std::abs(cur_mousex-clickx) <= double_click_tolerance
-              && std::abs(cur_mousey-clicky) <= double_click_tolerance) {
+        if (time - double_click_start <= double_click_interval && still) {
             input.double_click = true;
             input.mouse_left = false;
             double_click_start = -std::numeric_limits<double>::infinity();
         } else {
             double_click_start = time;
-            glfwGetCursorPos(window, &clickx, &clicky);
+            click = mouse;
         }
         break;
     }
@@ -81,6 +84,8 @@ void Input::glfw_mouse_button(GLFWwindow* window, int button, int action, int mo
         break;
     case GLFW_MOUSE_BUTTON_RIGHT:
         input.mouse_right = pressed;
+        if (pressed)
+            input.right_click = true;
         break;
     default:
         // Do nothing.
@@ -98,7 +103,7 @@ void Input::initialize(GLFWwindow* window)
 {
     assert(window != nullptr);
     this->window = window;
-    glfwGetCursorPos(window, &prev_mousex, &prev_mousey);
+    glfwGetCursorPos(window, &prev_mouse.x, &prev_mouse.y);
     glfwSetKeyCallback(window, glfw_key);
     glfwSetMouseButtonCallback(window, glfw_mouse_button);
     glfwSetScrollCallback(window, glfw_scroll);
@@ -111,16 +116,18 @@ void Input::frame()
     pany = 0;
     scroll = 0;
     double_click = false;
+    click = false;
+    right_click = false;
     f = 0;
 
     glfwPollEvents();
 
-    double mousex, mousey;
-    glfwGetCursorPos(window, &mousex, &mousey);
+    double2 mouse;
+    glfwGetCursorPos(window, &mouse.x, &mouse.y);
     if (mouse_left || mouse_middle) {
-        panx = static_cast<int>(mousex - prev_mousex);
-        pany = static_cast<int>(mousey - prev_mousey);
+        double2 pan = mouse - prev_mouse;
+        panx = static_cast<int>(pan.x);
+        pany = static_cast<int>(pan.y);
     }
-    prev_mousex = mousex;
-    prev_mousey = mousey;
+    prev_mouse = mouse;
 }
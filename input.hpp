@@ -3,12 +3,13 @@
 
 #include <memory>
 #include <GLFW/glfw3.h>
+#include "vecmath.hpp"
 
 class Input
 {
 private:
     static constexpr double double_click_interval = 0.5;  // maximum double click interval in seconds
-    static const int double_click_tolerance = 4;  // maximum double click mouse slip in pixels
+    static const int double_click_tolerance = 4;  // maximum click and double click mouse slip in pixels
 
     // GLFW callbacks
     static void glfw_key(GLFWwindow* window, int key, int scancode, int action, int mods);
@@ -18,8 +19,7 @@ private:
     Input() = default;
 
     GLFWwindow* window;
-    double prev_mousex;
-    double prev_mousey;
+    double2 prev_mouse;
 
 public:
     static Input instance;
@@ -36,6 +36,8 @@ public:
     bool mouse_middle;
     bool mouse_right;
     bool double_click;
+    bool click;  // left button released where it was pressed
+    bool right_click;
     int f;
     double scroll;
     int panx;
@@ -0,0 +1,81 @@
+#ifndef LOCKFREE_H
+#define LOCKFREE_H
+
+// Wait-free structures for handing data between exactly two threads
+
+#include <atomic>
+#include <stddef.h>
+
+// Latest-value hand-off. The producer fills back() and publishes it; the
+// consumer picks up the newest published slot. Neither side ever waits:
+// an unread slot is simply replaced by a newer one.
+template<typename T>
+class TripleBuffer
+{
+private:
+    static const int fresh = 0x4;  // the middle slot hasn't been acquired yet
+    static const int index_mask = 0x3;
+
+    std::atomic<int> middle { 1 };
+    int back_index = 0;
+    int front_index = 2;
+
+public:
+    T slots[3];
+
+    // Producer side
+    T& back() { return slots[back_index]; }
+
+    void publish()
+    {
+        back_index = middle.exchange(back_index | fresh, std::memory_order_acq_rel) & index_mask;
+    }
+
+    // Consumer side; returns false if nothing new was published
+    bool acquire()
+    {
+        if (!(middle.load(std::memory_order_relaxed) & fresh))
+            return false;
+        front_index = middle.exchange(front_index, std::memory_order_acq_rel) & index_mask;
+        return true;
+    }
+
+    T& front() { return slots[front_index]; }
+};
+
+// Bounded single-producer/single-consumer queue
+template<typename T, size_t capacity>
+class SpscQueue
+{
+private:
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of 2");
+
+    T items[capacity];
+    alignas(64) std::atomic<size_t> head { 0 };  // next to pop
+    alignas(64) std::atomic<size_t> tail { 0 };  // next to push
+
+public:
+    // Producer side; returns false if the queue is full
+    bool push(const T& item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == capacity)
+            return false;
+        items[t % capacity] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side; returns false if the queue is empty
+    bool pop(T* item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        *item = items[h % capacity];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif // LOCKFREE_H
@@ -0,0 +1,265 @@
+// ****************************************************************************
+// Tracked allocations: counted per subsystem against the memory budget,
+// cache-line aligned, and for the hot per-star arrays on 2 MB pages where the
+// system allows, so that the tree walk's scattered accesses don't miss the TLB
+// at every other node.
+// ****************************************************************************
+
+#include "memory.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "common.hpp"
+
+static const size_t cache_line = 64;
+static const size_t small_page = 4096;
+static const size_t huge_page = 2 << 20;
+
+enum page_kind: uint8_t { pages_heap, pages_small, pages_transparent, pages_reserved };
+
+// Precedes every block, a cache line long so that the data stays aligned
+struct alignas(cache_line) block_header
+{
+    size_t size;  // requested
+    size_t capacity;  // usable
+    size_t mapped;  // length of the block's own mapping, 0 on the heap
+    size_t counted;  // against its use
+    memory_use use;
+    page_kind pages;
+    bool hot;  // from hot_realloc(), in the stats
+    block_header* prev;  // the live blocks, for the stats
+    block_header* next;
+};
+
+static block_header* blocks = NULL;
+static std::mutex blocks_mutex;  // guards the list
+
+static const char* const use_names[memory_uses] = { "stars", "tree", "analysis", "display", "sprite", "text", "GL" };
+static std::atomic<size_t> current[memory_uses];
+static std::atomic<size_t> peak[memory_uses];
+static std::atomic<size_t> total;
+static std::atomic<size_t> total_peak;
+static std::atomic<bool> over_budget;
+
+static size_t budget()
+{
+    return (size_t)(config.memory_budget * 1048576);
+}
+
+static void raise_peak(std::atomic<size_t>& peak, size_t bytes)
+{
+    size_t old = peak.load(std::memory_order_relaxed);
+    while (old < bytes && !peak.compare_exchange_weak(old, bytes, std::memory_order_relaxed))
+        ;
+}
+
+// The budget is checked ahead of the big allocations; this only tells when an estimate fell short
+static void count(memory_use use, ptrdiff_t bytes)
+{
+    raise_peak(peak[use], current[use].fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    size_t now = total.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    raise_peak(total_peak, now);
+    if (bytes > 0 && budget() && now > budget() && !over_budget.exchange(true))
+        fprintf(stderr, "Memory budget exceeded: %.0f MB in use, MemoryBudget %g\n", now / 1048576.0, config.memory_budget);
+}
+
+// [length] bytes aligned to a huge page, [length] being a multiple of it
+static void* map_huge(size_t length, page_kind* pages)
+{
+    if (config.huge_pages == Config::HugePages::reserved) {
+        void* area = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (area != MAP_FAILED) {
+            *pages = pages_reserved;
+            return area;
+        }
+    }
+
+    // Transparent huge pages need the alignment: map a page more and trim
+    char* area = (char*)mmap(NULL, length + huge_page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED)
+        return NULL;
+    char* start = (char*)(((uintptr_t)area + huge_page - 1) & ~(uintptr_t)(huge_page - 1));
+    if (start > area)
+        munmap(area, start - area);
+    munmap(start + length, area + huge_page - start);
+    *pages = madvise(start, length, MADV_HUGEPAGE) == 0 ? pages_transparent : pages_small;
+    return start;
+}
+
+static block_header* allocate(memory_use use, size_t size, bool hot)
+{
+    size_t length = sizeof(block_header) + size;
+    block_header* header = NULL;
+    page_kind pages = pages_heap;
+    size_t mapped = 0;
+    if (hot && config.huge_pages != Config::HugePages::off && length >= huge_page) {
+        mapped = (length + huge_page - 1) & ~(huge_page - 1);
+        header = (block_header*)map_huge(mapped, &pages);
+    }
+    if (!header) {
+        pages = pages_heap;
+        mapped = 0;
+        if (posix_memalign((void**)&header, cache_line, length))
+            return NULL;
+    }
+    header->size = size;
+    header->capacity = mapped ? mapped - sizeof(block_header) : size;
+    header->mapped = mapped;
+    header->counted = mapped ? mapped : length;
+    header->use = use;
+    header->pages = pages;
+    header->hot = hot;
+    count(use, header->counted);
+
+    std::lock_guard<std::mutex> lock(blocks_mutex);
+    header->prev = NULL;
+    header->next = blocks;
+    if (blocks)
+        blocks->prev = header;
+    blocks = header;
+    return header;
+}
+
+static void release(block_header* header)
+{
+    {
+        std::lock_guard<std::mutex> lock(blocks_mutex);
+        if (header->prev)
+            header->prev->next = header->next;
+        else
+            blocks = header->next;
+        if (header->next)
+            header->next->prev = header->prev;
+    }
+    count(header->use, -(ptrdiff_t)header->counted);
+    if (header->mapped)
+        munmap(header, header->mapped);
+    else
+        free(header);
+}
+
+// Growing within the mapping is free; otherwise the data moves
+static void* reallocate(memory_use use, void* block, size_t size, bool hot)
+{
+    block_header* old = block ? (block_header*)block - 1 : NULL;
+    if (old && size <= old->capacity) {
+        old->size = size;
+        return block;
+    }
+    block_header* header = allocate(use, size, hot);
+    if (!header)
+        return NULL;
+    if (old) {
+        memcpy(header + 1, block, std::min(old->size, size));
+        release(old);
+    }
+    return header + 1;
+}
+
+void* hot_realloc(memory_use use, void* block, size_t size)
+{
+    return reallocate(use, block, size, true);
+}
+
+void* tracked_realloc(memory_use use, void* block, size_t size)
+{
+    return reallocate(use, block, size, false);
+}
+
+void tracked_free(void* block)
+{
+    if (block)
+        release((block_header*)block - 1);
+}
+
+void count_memory(memory_use use, size_t* counted, size_t bytes)
+{
+    count(use, (ptrdiff_t)bytes - (ptrdiff_t)*counted);
+    *counted = bytes;
+}
+
+bool memory_available(size_t bytes)
+{
+    return !budget() || total.load(std::memory_order_relaxed) + bytes <= budget();
+}
+
+bool check_memory_budget(size_t bytes, const char* what)
+{
+    if (memory_available(bytes))
+        return true;
+    fprintf(stderr, "%s need about %.0f MB more, over MemoryBudget %g with %.0f MB in use\n",
+            what, bytes / 1048576.0, config.memory_budget, total.load() / 1048576.0);
+    return false;
+}
+
+void print_memory_usage()
+{
+    printf("Memory     current MB   peak MB\n");
+    for (int use = 0; use < memory_uses; use++)
+        printf("%-10s %10.1f %9.1f\n", use_names[use], current[use].load() / 1048576.0, peak[use].load() / 1048576.0);
+    printf("%-10s %10.1f %9.1f\n", "total", total.load() / 1048576.0, total_peak.load() / 1048576.0);
+}
+
+// Share of the transparent blocks the kernel actually backs with huge pages.
+// Adjacent blocks may share a VMA, which is then split by overlap.
+static size_t transparent_huge_bytes()
+{
+    FILE* smaps = fopen("/proc/self/smaps", "r");
+    if (!smaps)
+        return 0;
+    size_t huge = 0;
+    unsigned long long start = 0;
+    unsigned long long end = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), smaps)) {
+        unsigned long long a, b, kb;
+        if (sscanf(line, "%llx-%llx", &a, &b) == 2) {
+            start = a;
+            end = b;
+        } else if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1 && kb) {
+            for (const block_header* block = blocks; block; block = block->next) {
+                if (block->pages != pages_transparent)
+                    continue;
+                unsigned long long low = std::max(start, (unsigned long long)(uintptr_t)block);
+                unsigned long long high = std::min(end, (unsigned long long)(uintptr_t)block + block->mapped);
+                if (low < high)
+                    huge += (size_t)(kb * 1024.0 * (high - low) / (end - start));
+            }
+        }
+    }
+    fclose(smaps);
+    return huge;
+}
+
+hot_memory_stats get_hot_memory_stats()
+{
+    std::lock_guard<std::mutex> lock(blocks_mutex);
+    hot_memory_stats stats = { 0, 0, 0 };
+    bool transparent = false;
+    for (const block_header* block = blocks; block; block = block->next) {
+        if (!block->hot)
+            continue;
+        size_t bytes = block->mapped ? block->mapped : sizeof(block_header) + block->capacity;
+        stats.bytes += bytes;
+        if (block->pages == pages_reserved)
+            stats.huge_bytes += bytes;
+        transparent |= block->pages == pages_transparent;
+    }
+    if (transparent)
+        stats.huge_bytes += transparent_huge_bytes();
+    stats.pages = stats.huge_bytes / huge_page + (stats.bytes - stats.huge_bytes + small_page - 1) / small_page;
+    return stats;
+}
+
+void print_hot_memory_stats()
+{
+    hot_memory_stats stats = get_hot_memory_stats();
+    printf("Hot arrays: %.1f MB, %.0f%% on 2 MB pages, %zu TLB entries\n", stats.bytes / 1048576.0,
+            stats.bytes ? 100.0 * stats.huge_bytes / stats.bytes : 0.0, stats.pages);
+}
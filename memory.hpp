@@ -0,0 +1,76 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <new>
+#include <stddef.h>
+#include <vector>
+
+// Tracked allocations of the world and the graphics.
+//
+// Every block is counted for the subsystem it belongs to, with its current
+// and peak size, and checked against MemoryBudget. Blocks are cache-line aligned.
+// Hot blocks of 2 MB and more are mapped on their own, on 2 MB pages as
+// HugePages asks: explicit pages from the reserved pool, or transparent ones,
+// which the kernel may or may not provide. A mapping that fails falls back to
+// transparent, then to small pages. tracked_free() takes blocks of both kinds.
+
+enum memory_use
+{
+    memory_stars,  // star and tracer state, per-star bookkeeping
+    memory_tree,  // nodes and the lists walking them
+    memory_analysis,  // densities and groups
+    memory_display,  // positions and colors handed to the renderer
+    memory_sprite,  // the star texture, before upload
+    memory_text,  // font and text buffers
+    memory_gl,  // buffers and textures on the GPU, as requested from GL
+    memory_uses
+};
+
+void* hot_realloc(memory_use use, void* block, size_t size);  // like realloc(), new bytes are not cleared
+void* tracked_realloc(memory_use use, void* block, size_t size);  // the same on the heap
+void tracked_free(void* block);
+
+// Memory allocated elsewhere, e.g. GL objects: [*counted] bytes become [bytes]
+void count_memory(memory_use use, size_t* counted, size_t bytes);
+
+// MemoryBudget: false and a message if [bytes] more don't fit
+bool check_memory_budget(size_t bytes, const char* what);
+bool memory_available(size_t bytes);  // silently
+void print_memory_usage();
+
+struct hot_memory_stats
+{
+    size_t bytes;  // in hot blocks
+    size_t huge_bytes;  // of them on 2 MB pages
+    size_t pages;  // TLB entries to map them all
+};
+
+hot_memory_stats get_hot_memory_stats();  // reads /proc/self/smaps, not for every frame
+void print_hot_memory_stats();
+
+// For containers
+template<typename T, memory_use use>
+struct tracked_allocator
+{
+    using value_type = T;
+    template<typename U> struct rebind { using other = tracked_allocator<U, use>; };
+
+    tracked_allocator() = default;
+    template<typename U> tracked_allocator(const tracked_allocator<U, use>&) {}
+
+    T* allocate(size_t n)
+    {
+        T* block = (T*)tracked_realloc(use, NULL, n * sizeof(T));
+        if (!block)
+            throw std::bad_alloc();
+        return block;
+    }
+    void deallocate(T* block, size_t) { tracked_free(block); }
+
+    bool operator==(const tracked_allocator&) const { return true; }
+};
+
+template<typename T, memory_use use>
+using tracked_vector = std::vector<T, tracked_allocator<T, use>>;
+
+#endif // MEMORY_H
@@ -0,0 +1,578 @@
+// ****************************************************************************
+// Streaming star positions from a headless server to remote viewers over TCP.
+// See net.hpp for the protocol.
+// ****************************************************************************
+
+#include "net.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "common.hpp"
+#include "graphics.hpp"
+#include "memory.hpp"
+#include "query.hpp"
+#include "world.hpp"
+
+static const int history_size = 8;  // frames kept as delta bases
+static const double quantum_per_view = 1.0 / 8192;  // position precision relative to the viewport
+static const int origin_grid = 20;  // the origin snaps to 2^origin_grid steps, about 128 viewports
+static const uint32_t max_stars = 1 << 28;  // sanity limit on what a peer announces
+static const size_t max_client_input = 64 * (sizeof(net_message) + sizeof(net_view));  // buffered per viewer
+static const double cull_margin = 0.1;  // relative to the viewport
+static const float hidden = 1e30f;  // display coordinate of culled stars
+
+struct net_star
+{
+    uint32_t index;
+    int32_t x;  // quantized coordinates
+    int32_t y;
+};
+
+struct net_record  // a sent or received frame
+{
+    uint32_t frame = NET_NO_BASE;
+    int32_t quantum;
+    double2 origin;
+    std::vector<net_star> stars;
+};
+
+struct net_client
+{
+    int socket;
+    bool has_view = false;
+    net_view view;
+    uint32_t next_frame = 0;
+    net_record history[history_size];
+    std::vector<uint8_t> in;
+    std::vector<uint8_t> out;
+    size_t out_pos = 0;  // sent part of out
+};
+
+static int listen_socket = -1;  // server
+static std::vector<net_client*> clients;
+static double send_time = 0;
+static int hello_version = 0;  // disp_star_color_version of the last hello
+static int server_socket = -1;  // viewer
+static std::vector<uint8_t> server_in;
+static net_record received[history_size];
+static uint32_t last_received = NET_NO_BASE;
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ================================= Encoding =================================
+
+static inline void put_varint(std::vector<uint8_t>& out, uint32_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(value | 0x80);
+        value >>= 7;
+    }
+    out.push_back(value);
+}
+
+static inline bool get_varint(const uint8_t*& p, const uint8_t* end, uint32_t* value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p >= end)
+            return false;
+        *value |= (uint32_t)(*p & 0x7F) << shift;
+        if (!(*(p++) & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static inline uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static void put_message(std::vector<uint8_t>& out, uint32_t type, const void* data, size_t size)
+{
+    net_message message = { type, (uint32_t)size };
+    out.insert(out.end(), (const uint8_t*)&message, (const uint8_t*)(&message + 1));
+    out.insert(out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+
+// Append the star list of [frame], delta-encoded against [base] if it's not NULL
+static void encode_stars(const net_record* base, const net_record& frame, std::vector<uint8_t>& out)
+{
+    size_t b = 0;
+    uint32_t next_index = 0;
+    for (const net_star& star : frame.stars) {
+        put_varint(out, star.index - next_index);
+        next_index = star.index + 1;
+        int32_t x0 = 0;
+        int32_t y0 = 0;
+        if (base) {
+            while (b < base->stars.size() && base->stars[b].index < star.index)
+                b++;
+            if (b < base->stars.size() && base->stars[b].index == star.index) {
+                x0 = base->stars[b].x;
+                y0 = base->stars[b].y;
+            }
+        }
+        put_varint(out, zigzag(star.x - x0));
+        put_varint(out, zigzag(star.y - y0));
+    }
+}
+
+static bool decode_stars(const uint8_t* p, const uint8_t* end, const net_record* base, uint32_t count, net_record& frame)
+{
+    if (count > (uint32_t)disp_stars || count > (size_t)(end - p) / 3)  // indices are distinct, a star takes 3 bytes at least
+        return false;
+    frame.stars.resize(count);
+    size_t b = 0;
+    uint32_t next_index = 0;
+    for (net_star& star : frame.stars) {
+        uint32_t gap, x, y;
+        if (!get_varint(p, end, &gap) || !get_varint(p, end, &x) || !get_varint(p, end, &y))
+            return false;
+        star.index = next_index + gap;
+        next_index = star.index + 1;
+        if (star.index >= (uint32_t)disp_stars)
+            return false;
+        star.x = unzigzag(x);
+        star.y = unzigzag(y);
+        if (base) {
+            while (b < base->stars.size() && base->stars[b].index < star.index)
+                b++;
+            if (b < base->stars.size() && base->stars[b].index == star.index) {
+                star.x += base->stars[b].x;
+                star.y += base->stars[b].y;
+            }
+        }
+    }
+    return p == end;
+}
+
+static inline int32_t view_quantum(const net_view& view)
+{
+    double size = fmax(view.xmax - view.xmin, view.ymax - view.ymin);
+    return (int32_t)floor(log2(size * quantum_per_view));
+}
+
+// Quantized zero for [view]: its center, snapped to the origin grid
+static inline double2 view_origin(const net_view& view, int32_t quantum)
+{
+    double grid = ldexp(1, quantum + origin_grid);
+    return { grid * round((view.xmin + view.xmax) / 2 / grid), grid * round((view.ymin + view.ymax) / 2 / grid) };
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ================================== Common ==================================
+
+static void set_nonblocking(int socket)
+{
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+    int nodelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
+
+// Read what is available, up to [limit] buffered; false if the connection is closed
+static bool receive(int socket, std::vector<uint8_t>& in, size_t limit)
+{
+    uint8_t buff[65536];
+    while (in.size() < limit) {
+        ssize_t length = recv(socket, buff, sizeof(buff), 0);
+        if (length > 0)
+            in.insert(in.end(), buff, buff + length);
+        else if (length == 0)
+            return false;
+        else
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    return true;
+}
+
+// Send as much as possible without blocking; false if the connection is broken
+static bool flush(int socket, std::vector<uint8_t>& out, size_t* pos)
+{
+    while (*pos < out.size()) {
+        ssize_t length = send(socket, out.data() + *pos, out.size() - *pos, MSG_NOSIGNAL);
+        if (length < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        *pos += length;
+    }
+    out.clear();
+    *pos = 0;
+    return true;
+}
+
+// Pop the next complete message from [in] into [payload]
+static bool next_message(std::vector<uint8_t>& in, size_t* pos, net_message* message, const uint8_t** payload)
+{
+    if (in.size() - *pos < sizeof(net_message))
+        return false;
+    memcpy(message, in.data() + *pos, sizeof(net_message));
+    if (in.size() - *pos - sizeof(net_message) < message->size)
+        return false;
+    *payload = in.data() + *pos + sizeof(net_message);
+    *pos += sizeof(net_message) + message->size;
+    return true;
+}
+
+static int open_socket(bool server)
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = server ? AI_PASSIVE : 0;
+    addrinfo* addresses;
+    std::string port = std::to_string(config.net_port);
+    int error = getaddrinfo(config.net_host.c_str(), port.c_str(), &hints, &addresses);
+    if (error) {
+        fprintf(stderr, "Cannot resolve '%s': %s\n", config.net_host.c_str(), gai_strerror(error));
+        return -1;
+    }
+    int sock = -1;
+    for (addrinfo* address = addresses; address; address = address->ai_next) {
+        sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (sock < 0)
+            continue;
+        if (server) {
+            int reuse = 1;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (bind(sock, address->ai_addr, address->ai_addrlen) == 0 && listen(sock, 8) == 0)
+                break;
+        } else if (connect(sock, address->ai_addr, address->ai_addrlen) == 0) {
+            break;
+        }
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addresses);
+    if (sock < 0)
+        fprintf(stderr, "Cannot %s %s:%d: %s\n", server ? "listen on" : "connect to",
+                config.net_host.c_str(), config.net_port, strerror(errno));
+    return sock;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ================================== Server ==================================
+
+static void close_client(size_t i)
+{
+    close(clients[i]->socket);
+    delete clients[i];
+    clients.erase(clients.begin() + i);
+}
+
+// Send the star count and colors; earlier frames become useless as delta bases
+static void send_hello(net_client* client)
+{
+    net_hello hello = { (uint32_t)disp_stars };
+    std::vector<uint8_t> payload((const uint8_t*)&hello, (const uint8_t*)(&hello + 1));
+    for (int i = 0; i < disp_stars; i++)
+        for (int c = 0; c < 3; c++)
+            payload.push_back((uint8_t)(255 * fmin(fmax(disp_star_color[i][c], 0), 1) + 0.5f));
+    put_message(client->out, NET_HELLO, payload.data(), payload.size());
+    for (net_record& record : client->history)
+        record.frame = NET_NO_BASE;
+}
+
+static void accept_clients()
+{
+    int sock;
+    while ((sock = accept(listen_socket, NULL, NULL)) >= 0) {
+        set_nonblocking(sock);
+        net_client* client = new net_client;
+        client->socket = sock;
+        send_hello(client);
+        clients.push_back(client);
+    }
+}
+
+// Apply the viewer's messages; false on a protocol error. Headers are checked
+// before their payload arrives, so that a bad size cannot make the server buffer
+// without bound.
+static bool read_client(net_client* client)
+{
+    size_t pos = 0;
+    net_message message;
+    const uint8_t* payload;
+    while (client->in.size() - pos >= sizeof(net_message)) {
+        memcpy(&message, client->in.data() + pos, sizeof(message));
+        if (message.type != NET_VIEW || message.size != sizeof(net_view))
+            return false;
+        if (!next_message(client->in, &pos, &message, &payload))
+            break;
+        memcpy(&client->view, payload, sizeof(net_view));
+        client->has_view = true;
+    }
+    client->in.erase(client->in.begin(), client->in.begin() + pos);
+    return true;
+}
+
+static void send_frame(net_client* client)
+{
+    const net_view& view = client->view;
+    net_record& frame = client->history[client->next_frame % history_size];
+    frame.frame = client->next_frame++;
+    frame.quantum = view_quantum(view);
+    frame.origin = view_origin(view, frame.quantum);
+    frame.stars.clear();
+    double margin = cull_margin * fmax(view.xmax - view.xmin, view.ymax - view.ymin);
+    double xmin = view.xmin - margin;
+    double ymin = view.ymin - margin;
+    double xmax = view.xmax + margin;
+    double ymax = view.ymax + margin;
+    double scale = ldexp(1, -frame.quantum);
+    static std::vector<int> inside;
+    query_rect(xmin, ymin, xmax, ymax, inside);
+    std::sort(inside.begin(), inside.end());  // the protocol lists stars by index
+    for (int i : inside)
+        if (i >= first_visible)
+            frame.stars.push_back({ (uint32_t)(i - first_visible),
+                    (int32_t)lround((stars[i].x - frame.origin.x) * scale),
+                    (int32_t)lround((stars[i].y - frame.origin.y) * scale) });
+    int index = config.stars - first_visible;  // visible escapers are displayed after the stars
+    for (const escaper& escaper : escapers) {
+        if (!escaper.visible)
+            continue;
+        if (escaper.x >= xmin && escaper.x <= xmax && escaper.y >= ymin && escaper.y <= ymax)
+            frame.stars.push_back({ (uint32_t)index, (int32_t)lround((escaper.x - frame.origin.x) * scale),
+                    (int32_t)lround((escaper.y - frame.origin.y) * scale) });
+        index++;
+    }
+
+    // Delta against the last acknowledged frame if it's still known and comparable
+    const net_record* base = NULL;
+    if (view.ack != NET_NO_BASE && frame.frame - view.ack < history_size) {
+        const net_record& candidate = client->history[view.ack % history_size];
+        if (candidate.frame == view.ack && candidate.quantum == frame.quantum
+                && candidate.origin.x == frame.origin.x && candidate.origin.y == frame.origin.y)
+            base = &candidate;
+    }
+    net_frame_header header = { frame.frame, base ? base->frame : NET_NO_BASE, frame.quantum, (uint32_t)frame.stars.size(),
+            frame.origin.x, frame.origin.y };
+    std::vector<uint8_t> payload((const uint8_t*)&header, (const uint8_t*)(&header + 1));
+    encode_stars(base, frame, payload);
+    put_message(client->out, NET_FRAME, payload.data(), payload.size());
+}
+
+static void server_frame()
+{
+    // Stars have been merged or removed
+    if (hello_version != disp_star_color_version) {
+        hello_version = disp_star_color_version;
+        for (net_client* client : clients)
+            send_hello(client);
+    }
+    accept_clients();
+    double time = get_time();
+    bool send = time - send_time >= 1 / config.net_fps;
+    if (send)
+        send_time = time;
+    for (size_t i = 0; i < clients.size(); i++) {
+        net_client* client = clients[i];
+        bool alive = receive(client->socket, client->in, max_client_input) && read_client(client)
+                && flush(client->socket, client->out, &client->out_pos);
+        // A slow viewer skips frames instead of stalling the simulation
+        if (alive && send && client->has_view && client->out.empty()) {
+            send_frame(client);
+            alive = flush(client->socket, client->out, &client->out_pos);
+        }
+        if (!alive)
+            close_client(i--);
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ================================== Viewer ==================================
+
+// Take the star count and colors from a hello message
+static bool apply_hello(const net_message& message, const uint8_t* payload)
+{
+    if (message.size < sizeof(net_hello))
+        return false;
+    net_hello hello;
+    memcpy(&hello, payload, sizeof(hello));
+    if (hello.stars > max_stars || message.size != sizeof(net_hello) + 3 * hello.stars)
+        return false;
+    if (hello.stars > (uint32_t)disp_star_capacity) {  // the server has spawned stars
+        disp_star_capacity = hello.stars;
+        disp_star_position = (float2*)hot_realloc(memory_display, disp_star_position, disp_star_capacity * sizeof(float2));
+        disp_star_color = (float3*)hot_realloc(memory_display, disp_star_color, disp_star_capacity * sizeof(float3));
+    }
+
+    disp_stars = hello.stars;
+    const uint8_t* color = payload + sizeof(net_hello);
+    for (int i = 0; i < disp_stars; i++) {
+        disp_star_position[i] = { hidden, hidden };
+        for (int c = 0; c < 3; c++)
+            disp_star_color[i][c] = *(color++) / 255.0f;
+    }
+    disp_star_color_version++;
+    for (net_record& record : received)
+        record.frame = NET_NO_BASE;
+    last_received = NET_NO_BASE;
+    return true;
+}
+
+// Wait for and read the first hello message
+static bool receive_hello()
+{
+    net_message message;
+    const uint8_t* payload;
+    size_t pos = 0;
+    while (!next_message(server_in, &pos, &message, &payload)) {
+        pollfd fd = { server_socket, POLLIN, 0 };
+        if (poll(&fd, 1, 10000) <= 0 || !receive(server_socket, server_in, SIZE_MAX))
+            return false;
+    }
+    if (message.type != NET_HELLO || !apply_hello(message, payload))
+        return false;
+    server_in.erase(server_in.begin(), server_in.begin() + pos);
+    return true;
+}
+
+// Decode received frames; false on a protocol error
+static bool read_server()
+{
+    size_t pos = 0;
+    net_message message;
+    const uint8_t* payload;
+    while (next_message(server_in, &pos, &message, &payload)) {
+        if (message.type == NET_HELLO) {
+            if (!apply_hello(message, payload))
+                return false;
+            continue;
+        }
+        net_frame_header header;
+        if (message.type != NET_FRAME || message.size < sizeof(header))
+            return false;
+        memcpy(&header, payload, sizeof(header));
+        const net_record* base = NULL;
+        if (header.base != NET_NO_BASE) {
+            base = &received[header.base % history_size];
+            if (base->frame != header.base)
+                return false;
+        }
+        net_record& frame = received[header.frame % history_size];
+        frame.frame = header.frame;
+        frame.quantum = header.quantum;
+        frame.origin = { header.origin_x, header.origin_y };
+        if (!decode_stars(payload + sizeof(header), payload + message.size, base, header.count, frame))
+            return false;
+        last_received = header.frame;
+    }
+    server_in.erase(server_in.begin(), server_in.begin() + pos);
+
+    // Rewritten every frame, as the display buffer may rotate between frames
+    if (last_received != NET_NO_BASE) {
+        const net_record* latest = &received[last_received % history_size];
+        for (int i = 0; i < disp_stars; i++)
+            disp_star_position[i] = { hidden, hidden };
+        double quantum = ldexp(1, latest->quantum);
+        for (const net_star& star : latest->stars) {
+            disp_star_position[star.index][0] = latest->origin.x + star.x * quantum;
+            disp_star_position[star.index][1] = latest->origin.y + star.y * quantum;
+        }
+    }
+    return true;
+}
+
+static bool viewer_frame()
+{
+    if (!receive(server_socket, server_in, SIZE_MAX) || !read_server()) {
+        fputs("Disconnected from the server\n", stderr);
+        return false;
+    }
+    view_rect rect = get_view_rect();
+    net_view view = { last_received, rect.xmin, rect.ymin, rect.xmax, rect.ymax };
+    std::vector<uint8_t> out;
+    size_t out_pos = 0;
+    put_message(out, NET_VIEW, &view, sizeof(view));
+    while (!flush(server_socket, out, &out_pos) || !out.empty()) {
+        pollfd fd = { server_socket, POLLOUT, 0 };
+        if (poll(&fd, 1, 1000) <= 0)
+            return false;
+    }
+    return true;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ================================= Interface ================================
+
+void finalize_net()
+{
+    while (!clients.empty())
+        close_client(clients.size() - 1);
+    if (listen_socket >= 0) {
+        close(listen_socket);
+        listen_socket = -1;
+    }
+    if (server_socket >= 0) {
+        close(server_socket);
+        server_socket = -1;
+    }
+}
+
+bool init_net()
+{
+    switch (config.net_mode) {
+    case Config::NetMode::off:
+        return true;
+    case Config::NetMode::server:
+        listen_socket = open_socket(true);
+        if (listen_socket < 0)
+            return false;
+        fcntl(listen_socket, F_SETFL, fcntl(listen_socket, F_GETFL) | O_NONBLOCK);
+        printf("Serving on %s:%d\n", config.net_host.c_str(), config.net_port);
+        return true;
+    case Config::NetMode::viewer:
+        server_socket = open_socket(false);
+        if (server_socket < 0)
+            return false;
+        set_nonblocking(server_socket);
+        if (!receive_hello()) {
+            fputs("No valid hello from the server\n", stderr);
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Serve or receive a frame; false if the viewer has lost the server
+bool net_frame()
+{
+    switch (config.net_mode) {
+    case Config::NetMode::server:
+        server_frame();
+        return true;
+    case Config::NetMode::viewer:
+        return viewer_frame();
+    default:
+        return true;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stdint.h>
+
+// Network protocol between a headless server and remote viewers.
+//
+// Every message is a net_message followed by its payload. Integers are
+// little-endian, the server and the viewers are assumed to share byte order.
+//
+// Server -> viewer:
+//   NET_HELLO  net_hello once after connecting, then 3 bytes of color per star
+//   NET_FRAME  net_frame_header, then star positions in the viewer's viewport
+// Viewer -> server:
+//   NET_VIEW   net_view with the viewport and the last decoded frame
+//
+// Positions are quantized to a power-of-two step tied to the viewport size,
+// relative to an origin near the viewport, so that they fit in 32 bits at any
+// zoom and anywhere in the world. The origin is snapped to a coarse grid, so
+// that it and the quantized positions stay comparable while the view pans.
+// A frame lists only the stars inside the viewport, by ascending index. Each
+// star is a varint gap from the previous index followed by zigzag varints of
+// its quantized x and y, relative to the same star in the base frame if it
+// was present there, or to the origin otherwise.
+
+#define NET_HELLO 1
+#define NET_FRAME 2
+#define NET_VIEW 3
+#define NET_NO_BASE 0xFFFFFFFF  // a key frame
+
+struct net_message
+{
+    uint32_t type;
+    uint32_t size;  // payload size
+};
+
+struct net_hello
+{
+    uint32_t stars;  // displayed, possibly none
+};
+
+struct net_frame_header
+{
+    uint32_t frame;
+    uint32_t base;  // frame the deltas refer to, or NET_NO_BASE
+    int32_t quantum;  // quantization step is 2^quantum
+    uint32_t count;  // stars in the frame
+    double origin_x;  // world position of the quantized zero
+    double origin_y;
+};
+
+struct net_view
+{
+    uint32_t ack;  // last decoded frame, or NET_NO_BASE
+    float xmin;
+    float ymin;
+    float xmax;
+    float ymax;
+};
+
+bool init_net();
+bool net_frame();
+void finalize_net();
+
+#endif // NET_H
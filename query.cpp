@@ -0,0 +1,130 @@
+// ****************************************************************************
+// Spatial queries over the Barnes–Hut tree: stars in a rectangle or a circle,
+// the nearest ones, and batches of them on the thread pool.
+// ****************************************************************************
+
+#include "query.hpp"
+
+#include <algorithm>
+
+void neighbor_heap::push(double distance_sqr, int star)
+{
+    if (count < k) {
+        items[count++] = { distance_sqr, star };
+        std::push_heap(items, items + count);
+    } else if (distance_sqr < items[0].distance_sqr) {
+        std::pop_heap(items, items + count);
+        items[count-1] = { distance_sqr, star };
+        std::push_heap(items, items + count);
+    }
+}
+
+void knn_search(const quad* node, const double2& point, const quad* skip, neighbor_heap& heap)
+{
+    const quad* children[4];
+    double distances[4];
+    int n = 0;
+    for (const quad* child : node->children) {
+        if (!child || child == skip)
+            continue;
+        double dx, dy;
+        if (child->size) {
+            dx = fmax(fabs(point.x - child->center.x) - child->size/2 - tree_slack, 0);
+            dy = fmax(fabs(point.y - child->center.y) - child->size/2 - tree_slack, 0);
+        } else {
+            dx = child->x - point.x;
+            dy = child->y - point.y;
+        }
+        int k = n++;
+        for (; k > 0 && distances[k-1] > dx*dx + dy*dy; k--) {
+            children[k] = children[k-1];
+            distances[k] = distances[k-1];
+        }
+        children[k] = child;
+        distances[k] = dx*dx + dy*dy;
+    }
+    for (int k = 0; k < n && distances[k] < heap.bound(); k++) {
+        if (children[k]->size)
+            knn_search(children[k], point, skip, heap);
+        else
+            heap.push(distances[k], (const star*)children[k] - stars);
+    }
+}
+
+void query_rect(double xmin, double ymin, double xmax, double ymax, std::vector<int>& found)
+{
+    found.clear();
+    for_each_inside(&quads[0], xmin, ymin, xmax, ymax, [&](star* star) {
+        found.push_back(star - stars);
+    });
+}
+
+void query_radius(double x, double y, double radius, std::vector<int>& found)
+{
+    found.clear();
+    for_each_near(&quads[0], { x, y }, radius, [&](star* star) {
+        found.push_back(star - stars);
+    });
+}
+
+int query_nearest(double x, double y)
+{
+    neighbor nearest;
+    neighbor_heap heap = { &nearest, 1 };
+    knn_search(&quads[0], { x, y }, NULL, heap);
+    return heap.count ? nearest.star : -1;
+}
+
+void query_nearest(double x, double y, int k, std::vector<int>& found)
+{
+    found.clear();
+    if (k <= 0)
+        return;
+    std::vector<neighbor> items(k);
+    neighbor_heap heap = { items.data(), k };
+    knn_search(&quads[0], { x, y }, NULL, heap);
+    std::sort_heap(items.begin(), items.begin() + heap.count);
+    for (int i = 0; i < heap.count; i++)
+        found.push_back(items[i].star);
+}
+
+
+//*****************************
+// Batches
+//*****************************
+
+static const double2* batch_points;
+static int batch_count;
+static double batch_radius;
+static int batch_k;
+static std::vector<int>* batch_found;
+
+static void radius_batch(int thread)
+{
+    for (int i = thread; i < batch_count; i += cores)
+        query_radius(batch_points[i].x, batch_points[i].y, batch_radius, batch_found[i]);
+}
+
+static void nearest_batch(int thread)
+{
+    for (int i = thread; i < batch_count; i += cores)
+        query_nearest(batch_points[i].x, batch_points[i].y, batch_k, batch_found[i]);
+}
+
+void query_radius(const double2* points, int count, double radius, std::vector<int>* found)
+{
+    batch_points = points;
+    batch_count = count;
+    batch_radius = radius;
+    batch_found = found;
+    run_pool(radius_batch);
+}
+
+void query_nearest(const double2* points, int count, int k, std::vector<int>* found)
+{
+    batch_points = points;
+    batch_count = count;
+    batch_k = k;
+    batch_found = found;
+    run_pool(nearest_batch);
+}
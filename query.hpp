@@ -0,0 +1,89 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <math.h>
+#include <vector>
+#include "world.hpp"
+
+// Spatial queries over the current frame's tree, in O(log N + k).
+//
+// Results are indices into stars[], of every species, visible or not; stars
+// kept outside the tree as escapers are never found. Tree nodes keep the
+// bounds they had when the frame started, widened by tree_slack for the
+// drift since, so queries between frames are exact. In a periodic box a star
+// wrapped during the last step can be missed until the next frame.
+// Queries only read the tree: they may run concurrently with each other, but
+// not with world_frame().
+
+// Call found(star) for every star within [radius] of [center]
+template<typename F>
+void for_each_near(const quad* node, const double2& center, double radius, F&& found)
+{
+    for (const quad* child : node->children) {
+        if (!child)
+            continue;
+        if (child->size == 0) {
+            double dx = child->x - center.x;
+            double dy = child->y - center.y;
+            if (dx*dx + dy*dy <= radius*radius)
+                found((star*)child);
+            continue;
+        }
+        double dx = fmax(fabs(center.x - child->center.x) - child->size/2 - tree_slack, 0);  // distance to the box
+        double dy = fmax(fabs(center.y - child->center.y) - child->size/2 - tree_slack, 0);
+        if (dx*dx + dy*dy <= radius*radius)
+            for_each_near(child, center, radius, found);
+    }
+}
+
+// Call found(star) for every star inside the rectangle
+template<typename F>
+void for_each_inside(const quad* node, double xmin, double ymin, double xmax, double ymax, F&& found)
+{
+    for (const quad* child : node->children) {
+        if (!child)
+            continue;
+        if (child->size == 0) {
+            if (child->x >= xmin && child->x <= xmax && child->y >= ymin && child->y <= ymax)
+                found((star*)child);
+            continue;
+        }
+        double half = child->size/2 + tree_slack;
+        if (child->center.x + half >= xmin && child->center.x - half <= xmax &&
+                child->center.y + half >= ymin && child->center.y - half <= ymax)
+            for_each_inside(child, xmin, ymin, xmax, ymax, found);
+    }
+}
+
+struct neighbor
+{
+    double distance_sqr;
+    int star;
+
+    bool operator<(const neighbor& other) const { return distance_sqr < other.distance_sqr; }
+};
+
+// The k nearest neighbors so far in caller's storage, the farthest on top
+struct neighbor_heap
+{
+    neighbor* items;
+    int k;
+    int count = 0;
+
+    double bound() const { return count < k ? INFINITY : items[0].distance_sqr; }
+    void push(double distance_sqr, int star);
+};
+
+// Nearest children first, skipping the subtree already searched
+void knn_search(const quad* node, const double2& point, const quad* skip, neighbor_heap& heap);
+
+void query_rect(double xmin, double ymin, double xmax, double ymax, std::vector<int>& found);
+void query_radius(double x, double y, double radius, std::vector<int>& found);
+int query_nearest(double x, double y);  // -1 without stars
+void query_nearest(double x, double y, int k, std::vector<int>& found);  // nearest first
+
+// Batches on the thread pool, found[i] for points[i]
+void query_radius(const double2* points, int count, double radius, std::vector<int>* found);
+void query_nearest(const double2* points, int count, int k, std::vector<int>* found);
+
+#endif // QUERY_H
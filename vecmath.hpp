@@ -0,0 +1,183 @@
+#ifndef VECMATH_H
+#define VECMATH_H
+
+// Small vectors and matrices for the simulation and the renderer.
+//
+// Everything is header-only and constexpr. Vectors are aggregates with named
+// components laid out like arrays, so arrays of them go to GL as they are.
+// double2 and float4 are aligned to their size, so that one fits a SIMD
+// register and loops over them vectorize.
+
+#include <math.h>
+#include <type_traits>
+
+template<typename T, int N> struct vec;
+
+template<typename T>
+struct alignas(2 * sizeof(T)) vec<T, 2>
+{
+    T x;
+    T y;
+
+    constexpr T& operator[](int i) { return i ? y : x; }
+    constexpr const T& operator[](int i) const { return i ? y : x; }
+    T* data() { return &x; }
+    const T* data() const { return &x; }
+};
+
+template<typename T>
+struct vec<T, 3>  // not padded: colors are uploaded as packed triples
+{
+    T x;
+    T y;
+    T z;
+
+    constexpr T& operator[](int i) { return i == 0 ? x : i == 1 ? y : z; }
+    constexpr const T& operator[](int i) const { return i == 0 ? x : i == 1 ? y : z; }
+    T* data() { return &x; }
+    const T* data() const { return &x; }
+};
+
+template<typename T>
+struct alignas(4 * sizeof(T)) vec<T, 4>
+{
+    T x;
+    T y;
+    T z;
+    T w;
+
+    constexpr T& operator[](int i) { return i == 0 ? x : i == 1 ? y : i == 2 ? z : w; }
+    constexpr const T& operator[](int i) const { return i == 0 ? x : i == 1 ? y : i == 2 ? z : w; }
+    T* data() { return &x; }
+    const T* data() const { return &x; }
+};
+
+using float2 = vec<float, 2>;
+using float3 = vec<float, 3>;
+using float4 = vec<float, 4>;
+using double2 = vec<double, 2>;
+
+// Scalars don't take part in deduction, so float2 * 0.5 is a float2
+template<typename T>
+using scalar = std::type_identity_t<T>;
+
+template<typename T, int N>
+constexpr vec<T, N>& operator+=(vec<T, N>& a, const vec<T, N>& b)
+{
+    for (int i = 0; i < N; i++)
+        a[i] += b[i];
+    return a;
+}
+
+template<typename T, int N>
+constexpr vec<T, N>& operator-=(vec<T, N>& a, const vec<T, N>& b)
+{
+    for (int i = 0; i < N; i++)
+        a[i] -= b[i];
+    return a;
+}
+
+template<typename T, int N>
+constexpr vec<T, N>& operator*=(vec<T, N>& a, scalar<T> s)
+{
+    for (int i = 0; i < N; i++)
+        a[i] *= s;
+    return a;
+}
+
+template<typename T, int N>
+constexpr vec<T, N>& operator/=(vec<T, N>& a, scalar<T> s)
+{
+    for (int i = 0; i < N; i++)
+        a[i] /= s;
+    return a;
+}
+
+template<typename T, int N>
+constexpr vec<T, N> operator+(vec<T, N> a, const vec<T, N>& b) { return a += b; }
+
+template<typename T, int N>
+constexpr vec<T, N> operator-(vec<T, N> a, const vec<T, N>& b) { return a -= b; }
+
+template<typename T, int N>
+constexpr vec<T, N> operator-(vec<T, N> a) { return a *= -1; }
+
+template<typename T, int N>
+constexpr vec<T, N> operator*(vec<T, N> a, scalar<T> s) { return a *= s; }
+
+template<typename T, int N>
+constexpr vec<T, N> operator*(scalar<T> s, vec<T, N> a) { return a *= s; }
+
+template<typename T, int N>
+constexpr vec<T, N> operator/(vec<T, N> a, scalar<T> s) { return a /= s; }
+
+template<typename T, int N>
+constexpr bool operator==(const vec<T, N>& a, const vec<T, N>& b)
+{
+    for (int i = 0; i < N; i++)
+        if (a[i] != b[i])
+            return false;
+    return true;
+}
+
+template<typename T, int N>
+constexpr T dot(const vec<T, N>& a, const vec<T, N>& b)
+{
+    T sum = a[0] * b[0];
+    for (int i = 1; i < N; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+template<typename T, int N>
+inline T length(const vec<T, N>& a)
+{
+    return sqrt(dot(a, a));
+}
+
+// Converts every component, e.g. world coordinates to GLfloat
+template<typename U, typename T, int N>
+constexpr vec<U, N> vec_cast(const vec<T, N>& a)
+{
+    vec<U, N> b = {};
+    for (int i = 0; i < N; i++)
+        b[i] = (U)a[i];
+    return b;
+}
+
+// Column-major, as glUniformMatrix4fv() takes it
+struct float4x4
+{
+    float4 columns[4];
+
+    const float* data() const { return columns[0].data(); }
+};
+
+constexpr float4x4 identity()
+{
+    return { { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } } };
+}
+
+// Maps the box onto the clip space cube, like glOrtho()
+constexpr float4x4 ortho(float left, float right, float bottom, float top, float z_near, float z_far)
+{
+    float4x4 m = identity();
+    m.columns[0].x = 2 / (right - left);
+    m.columns[1].y = 2 / (top - bottom);
+    m.columns[2].z = -2 / (z_far - z_near);
+    m.columns[3] = { -(right + left) / (right - left), -(top + bottom) / (top - bottom), -(z_far + z_near) / (z_far - z_near), 1 };
+    return m;
+}
+
+// Compile-time checks
+static_assert(sizeof(float2) == 2 * sizeof(float) && sizeof(float3) == 3 * sizeof(float),
+        "arrays of vectors are uploaded to GL as they are");
+static_assert(alignof(double2) == 16 && alignof(float4) == 16);
+static_assert(double2{ 1, 2 } + double2{ 3, 4 } == double2{ 4, 6 });
+static_assert(0.5f * float2{ 2, 4 } - float2{ 1, 1 } == float2{ 0, 1 });
+static_assert(dot(float3{ 1, 2, 3 }, float3{ 4, 5, 6 }) == 32);
+static_assert(vec_cast<float>(double2{ 0.5, -2 }) == float2{ 0.5f, -2 });
+static_assert(ortho(0, 2, 0, 4, -1, 1).columns[0].x == 1 && ortho(0, 2, 0, 4, -1, 1).columns[1].y == 0.5f);
+static_assert(ortho(0, 2, 0, 4, -1, 1).columns[3] == float4{ -1, -1, 0, 1 });
+
+#endif // VECMATH_H
@@ -6,7 +6,6 @@
 
 #include "world.hpp"
 
-#include <assert.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdbool.h>
@@ -15,34 +14,119 @@
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <limits>
 #include <GLFW/glfw3.h>
-#include "linmath.h"
+#include "vecmath.hpp"
 #include "common.hpp"
+#include "memory.hpp"
+#include "query.hpp"
 
-// Star or quadrant
-struct node: vecd2 // the vec2d is the center of mass
+// Hot loops are compiled for several instruction sets, and the loader picks
+// one by CPUID. AVX-512 has FMA, which stays off so results don't depend on the CPU.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MULTIVERSION __attribute__((target_clones("avx512f", "avx2", "default"), optimize("fp-contract=off")))
+#else
+#define MULTIVERSION
+#endif
+
+star* stars = NULL;
+star_motion motion = { NULL, NULL, NULL, NULL };
+quad* quads = NULL;
+tracer* tracers = NULL;
+tracked_vector<escaper, memory_stars> escapers;
+double world_time = 0;  // simulated time
+std::vector<species_range> star_species;
+int first_visible = 0;
+std::vector<fof_group> fof_groups;
+int fof_catalogs = 0;
+double* star_density = NULL;
+double tree_slack = 0;
+#ifdef COMPACT_STARS
+double grid_origin[2] = { 0, 0 };
+#endif
+
+int cores;
+static pthread_t *threads = NULL;  // thread pool
+static sem_t* job_start = NULL;  // thread pool semaphores, one per thread
+static sem_t job_finish;
+static void (*pool_job)(int thread);  // the job being run by the pool
+static double frame_time;  // stays constant during a frame
+static void (*update_stars_job)(int thread);  // kernels specialized for the configuration
+static void (*update_groups_job)(int thread);
+static void (*update_tracers_job)(int thread);
+static void select_kernels();
+static void free_motion(star_motion* motion);
+static size_t quad_count = 0;  // quads in use by the current tree
+static size_t quad_capacity = 0;  // quads allocated
+static int* kd_order = NULL;  // star indices, partitioned by the k-d tree
+
+// Cached interaction lists
+struct interaction_group
 {
-    double mass;
-    double size;  // zero for a star
+    int first_member;  // in interaction_lists::members
+    int members;
+    int first_source;  // in interaction_lists::sources
+    int sources;
 };
 
-static struct star: node
+typedef tracked_vector<const node*, memory_tree> source_list;  // nodes taken as a whole, or stars
+
+struct interaction_lists  // built and used by the same thread
 {
-    struct vecd2 speed;
-    struct vecd2 accel;  // already multiplied by t/2, for better performance
-} *stars = NULL;
+    tracked_vector<interaction_group, memory_tree> groups;
+    tracked_vector<int, memory_tree> members;  // star indices
+    source_list sources;
+};
 
-static struct quad: node
+struct group_bounds
 {
-    struct vecd2 center; // geometrical center
-    struct quad* children[4];  // 4 quadrants
-} *quads = NULL;
+    double xmin;
+    double ymin;
+    double xmax;
+    double ymax;
+};
 
-static int cores;
-static pthread_t *threads = NULL;  // thread pool
-static sem_t job_start;  // thread pool semaphores
-static sem_t job_finish;
-static double frame_time;  // stays constant during a frame
+static const int group_size = 32;  // maximum stars sharing a list
+static tracked_vector<const quad*, memory_tree> group_roots;  // nodes or stars
+static struct interaction_lists* lists = NULL;  // per thread
+static bool lists_valid = false;  // the lists match the tree
+static double2* list_anchors = NULL;  // star positions when the lists were built
+static double* list_sizes = NULL;  // quad sizes when the lists were built
+static group_bounds* quad_bounds = NULL;  // around the stars under each quad, while refitting
+static int* quad_stars = NULL;  // stars under each quad
+static int* fof_parent = NULL;  // union-find forest, per star
+static int fof_capacity = 0;
+static double* star_softening = NULL;  // per star, when the softenings differ
+static double* quad_softening = NULL;  // the largest under each quad
+static int density_capacity = 0;
+static bool density_stale = true;  // the star set has changed since the last estimate
+static tracked_vector<const quad*, memory_tree> density_groups;
+static int star_capacity = 0;  // stars allocated in the per-star arrays
+static std::vector<double2> spawn_requests;  // galaxy centers
+static double2 focus = { 0, 0 };  // center of the region of interest
+static int picked = -1;  // star index, or -1
+static int picked_version = 0;  // disp_star_color_version when it was picked
+static const int ewald_size = 64;  // table cells per half box
+static double2 (*ewald_table)[ewald_size+1] = NULL;  // periodic correction over [0, box/2]²
+
+// Merging and escapers
+enum star_state: uint8_t { star_kept, star_merged, star_removed };
+static uint8_t* star_states = NULL;  // per star
+static uint8_t* star_coarsening = NULL;  // per star with RefineRadius: merges by rebalance() it holds
+static tracked_vector<std::pair<int, int>, memory_stars>* merge_candidates = NULL;  // per thread
+static tracked_vector<int, memory_stars>* found_stars = NULL;  // per thread
+static double2 galaxy_center;  // center of mass of the tree
+static double2 galaxy_speed;  // of the center of mass
+static double galaxy_mass;
+static int escaper_colors_version = -1;  // disp_star_color_version when escaper colors were last shown
+static star* spare_stars = NULL;  // compaction target
+static star_motion spare_motion = { NULL, NULL, NULL, NULL };
+static float3* spare_colors = NULL;
+static uint8_t* spare_coarsening = NULL;
+static int* compact_offsets = NULL;  // per thread
+static int new_first_visible;
 
 void finalize_world()
 {
@@ -51,105 +135,452 @@ void finalize_world()
             pthread_cancel(threads[i]);
         for (int i = 1; i < cores; i++)
             pthread_join(threads[i], NULL);
-        sem_destroy(&job_start);
+        for (int i = 1; i < cores; i++)
+            sem_destroy(&job_start[i]);
         sem_destroy(&job_finish);
+        free(job_start);
         free(threads);
+        job_start = NULL;
         threads = NULL;
     }
     if (stars) {
-        free(stars);
+        tracked_free(stars);
+        free_motion(&motion);
         stars = NULL;
     }
     if (quads) {
-        free(quads);
+        tracked_free(quads);
         quads = NULL;
+        quad_capacity = 0;
+    }
+    if (tracers) {
+        tracked_free(tracers);
+        tracers = NULL;
+    }
+    if (star_states) {
+        tracked_free(star_states);
+        tracked_free(spare_stars);
+        free_motion(&spare_motion);
+        tracked_free(spare_colors);
+        tracked_free(star_coarsening);
+        tracked_free(spare_coarsening);
+        tracked_free(compact_offsets);
+        delete[] merge_candidates;
+        delete[] found_stars;
+        star_states = NULL;
+        spare_stars = NULL;
+        spare_colors = NULL;
+        star_coarsening = NULL;
+        spare_coarsening = NULL;
+        compact_offsets = NULL;
+        merge_candidates = NULL;
+        found_stars = NULL;
+    }
+    if (kd_order) {
+        tracked_free(kd_order);
+        kd_order = NULL;
+    }
+    if (fof_parent) {
+        tracked_free(fof_parent);
+        fof_parent = NULL;
+        fof_capacity = 0;
+    }
+    fof_groups.clear();
+    if (star_density) {
+        tracked_free(star_density);
+        star_density = NULL;
+        density_capacity = 0;
+    }
+    if (star_softening) {
+        tracked_free(star_softening);
+        tracked_free(quad_softening);
+        star_softening = NULL;
+        quad_softening = NULL;
+    }
+    density_stale = true;
+    if (quad_stars) {
+        tracked_free(quad_stars);
+        quad_stars = NULL;
+    }
+    if (list_anchors) {
+        tracked_free(list_anchors);
+        list_anchors = NULL;
+    }
+    if (list_sizes) {
+        tracked_free(list_sizes);
+        tracked_free(quad_bounds);
+        list_sizes = NULL;
+        quad_bounds = NULL;
+    }
+    delete[] lists;
+    lists = NULL;
+    lists_valid = false;
+    if (ewald_table) {
+        tracked_free(ewald_table);
+        ewald_table = NULL;
+    }
+    if (disp_tracer_position) {
+        tracked_free(disp_tracer_position);
+        disp_tracer_position = NULL;
     }
     if (disp_star_position) {
-        free(disp_star_position);
+        tracked_free(disp_star_position);
         disp_star_position = NULL;
     }
     if (disp_star_color) {
-        free(disp_star_color);
+        tracked_free(disp_star_color);
         disp_star_color = NULL;
     }
+    star_capacity = 0;
+    disp_star_capacity = 0;
+    star_species.clear();
+    escapers.clear();
+    spawn_requests.clear();
 }
 
-// Recursive walk through the qtree
-static void get_accel(struct star* star, const struct quad* node, struct vecd2* accel)
+// A pair takes the larger of its softenings, so that the forces stay reciprocal.
+// A node stands for the largest under it.
+static inline double source_softening(const node* node)
 {
-    double dx = node->x - star->x;
-    double dy = node->y - star->y;
-    double distance_sqr = dx*dx + dy*dy;
-    if (sqrt(distance_sqr) > node->size * config.accuracy) {
-        double angle = atan2(dy, dx);
-        double accel_abs = node->mass / (distance_sqr + config.epsilon);
-        accel->x += accel_abs * cos(angle);
-        accel->y += accel_abs * sin(angle);
+    if (node->size)
+        return quad_softening[(const quad*)node - quads];
+    return star_softening[(const star*)node - stars];
+}
+
+double node_softening(const node* node)
+{
+    return star_softening ? source_softening(node) : star_species[0].softening;
+}
+
+// Recursive walk through the qtree. Differences are taken in double, then rounded to [real].
+// [softening] is the star's own.
+template<typename real>
+static void get_accel(const double2* star, const quad* node, real softening, vec<real, 2>* accel)
+{
+    vec<real, 2> d = vec_cast<real>((double2)*node - *star);
+    real distance_sqr = dot(d, d);
+    real distance = std::sqrt(distance_sqr);
+    if (distance > (real)(node->size * config.accuracy)) {
+        real pair_softening = star_softening ? std::max(softening, (real)source_softening(node)) : softening;
+        *accel += d * ((real)node->mass / ((distance_sqr + pair_softening) * distance));
     } else if (node->size) {
         if (node->children[0])
-            get_accel(star, node->children[0], accel);
+            get_accel(star, node->children[0], softening, accel);
         if (node->children[1])
-            get_accel(star, node->children[1], accel);
+            get_accel(star, node->children[1], softening, accel);
         if (node->children[2])
-            get_accel(star, node->children[2], accel);
+            get_accel(star, node->children[2], softening, accel);
         if (node->children[3])
-            get_accel(star, node->children[3], accel);
+            get_accel(star, node->children[3], softening, accel);
+    } // else the same star or another star with the same coordinates
+}
+
+
+//*****************************
+// Periodic boundaries
+//*****************************
+
+// Nearest image of a coordinate or a difference, in [-box/2, box/2)
+static inline double wrap(double x)
+{
+    return x - config.box_size * floor(x / config.box_size + 0.5);
+}
+
+// The same for a difference of wrapped coordinates, which is within (-box, box)
+static inline double nearest_image(double d)
+{
+    double half_box = config.box_size / 2;
+    if (d >= half_box)
+        return d - config.box_size;
+    if (d < -half_box)
+        return d + config.box_size;
+    return d;
+}
+
+// Acceleration towards a unit mass at [dx, dy] and all its periodic images,
+// minus the nearest image itself. Ewald summation with α = 2 / box.
+static double2 ewald_correction(const double2& d)
+{
+    const int images = 4;  // in each direction, in both spaces
+    double box = config.box_size;
+    double alpha = 2 / box;
+    double2 accel = { 0, 0 };
+    for (int nx = -images; nx <= images; nx++)
+    for (int ny = -images; ny <= images; ny++) {
+        double2 image = d + double2{ nx * box, ny * box };
+        double s = length(image);
+        if (s == 0)
+            continue;
+        accel += image * ((erfc(alpha * s) / s + 2 * alpha / sqrt(M_PI) * exp(-alpha*alpha * s*s)) / (s*s));
+    }
+    for (int hx = -images; hx <= images; hx++)
+    for (int hy = -images; hy <= images; hy++) {
+        if (!hx && !hy)
+            continue;
+        double2 k = double2{ (double)hx, (double)hy } * (2 * M_PI / box);
+        accel += k * (2 * M_PI / (box*box) * erfc(length(k) / (2*alpha)) / length(k) * sin(dot(k, d)));
+    }
+    double distance_sqr = dot(d, d);
+    if (distance_sqr > 0)
+        accel -= d / (distance_sqr * sqrt(distance_sqr));
+    return accel;
+}
+
+// The correction is odd in x and y, so a quarter of the half box is enough
+static void init_ewald_table()
+{
+    ewald_table = (double2(*)[ewald_size+1])tracked_realloc(memory_tree, NULL, (ewald_size+1) * sizeof(*ewald_table));
+    double step = config.box_size / 2 / ewald_size;
+    for (int i = 0; i <= ewald_size; i++)
+    for (int j = 0; j <= ewald_size; j++)
+        ewald_table[i][j] = ewald_correction({ i * step, j * step });
+}
+
+// Bilinear interpolation of the table
+template<typename real>
+static inline void add_ewald_correction(const double2& d, double mass, vec<real, 2>* accel)
+{
+    double scale = 2 * ewald_size / config.box_size;
+    double u = fabs(d.x) * scale;
+    double v = fabs(d.y) * scale;
+    int i = std::min((int)u, ewald_size - 1);
+    int j = std::min((int)v, ewald_size - 1);
+    u -= i;
+    v -= j;
+    const double2& c00 = ewald_table[i][j];
+    const double2& c01 = ewald_table[i][j+1];
+    const double2& c10 = ewald_table[i+1][j];
+    const double2& c11 = ewald_table[i+1][j+1];
+    double2 c = (1-u) * ((1-v) * c00 + v * c01) + u * ((1-v) * c10 + v * c11);
+    accel->x += mass * (d.x < 0 ? -c.x : c.x);
+    accel->y += mass * (d.y < 0 ? -c.y : c.y);
+}
+
+// get_accel() with the nearest image of every node, corrected for the others
+template<typename real>
+static void get_periodic_accel(const double2* star, const quad* node, real softening, vec<real, 2>* accel)
+{
+    double2 d = { nearest_image(node->x - star->x), nearest_image(node->y - star->y) };
+    vec<real, 2> rd = vec_cast<real>(d);
+    real distance_sqr = dot(rd, rd);
+    real distance = std::sqrt(distance_sqr);
+    bool accepted = distance > (real)(node->size * config.accuracy);
+    if (accepted && node->size) {  // the whole node must be in the star's nearest box
+        double half_box = config.box_size / 2;
+        accepted = fabs(nearest_image(node->center.x - star->x)) + node->size/2 < half_box
+                && fabs(nearest_image(node->center.y - star->y)) + node->size/2 < half_box;
+    }
+    if (accepted) {
+        real pair_softening = star_softening ? std::max(softening, (real)source_softening(node)) : softening;
+        *accel += rd * ((real)node->mass / ((distance_sqr + pair_softening) * distance));
+        add_ewald_correction(d, node->mass, accel);
+    } else if (node->size) {
+        for (const quad* child : node->children)
+            if (child)
+                get_periodic_accel(star, child, softening, accel);
     } // else the same star or another star with the same coordinates
 }
 
-static void update_stars(int thread)
+// The boundaries are a template parameter, so that the per-star walk has no branch on them
+template<typename real, bool periodic>
+static inline void get_tree_accel(const double2* star, real softening, vec<real, 2>* accel)
+{
+    if (periodic)
+        get_periodic_accel(star, &quads[0], softening, accel);
+    else
+        get_accel(star, &quads[0], softening, accel);
+}
+
+// Background potential centered at the origin; adds to the acceleration
+template<Config::Halo halo>
+static inline void add_halo_accel(double x, double y, double* ax, double* ay)
 {
-    for (int i = thread; i < config.stars; i += cores) {
-         struct vecd2 accel = { 0 };
-         get_accel(&stars[i], &quads[0], &accel);
-         accel.x *= frame_time * config.gravity / 2;
-         accel.y *= frame_time * config.gravity / 2;
-         stars[i].speed.x += stars[i].accel.x + accel.x;  // velocity Verlet integration
-         stars[i].speed.y += stars[i].accel.y + accel.y;
-         stars[i].accel = accel;
-     }
+    double r2 = x*x + y*y + 1e-12;  // avoid 0/0 at the center
+    double r = sqrt(r2);
+    double factor = 0;  // acceleration / r
+    switch (halo) {
+    case Config::Halo::nfw: {
+        double s = r / config.halo_radius;
+        factor = config.gravity * config.halo_mass * (log1p(s) - s/(1+s)) / (r2 * r);
+        break;
+    }
+    case Config::Halo::isothermal:  // pseudo-isothermal sphere
+        factor = config.halo_speed * config.halo_speed
+                * (1 - config.halo_radius / r * atan(r / config.halo_radius)) / r2;
+        break;
+    case Config::Halo::logarithmic:
+        factor = config.halo_speed * config.halo_speed / (config.halo_radius * config.halo_radius + r2);
+        break;
+    default:
+        break;
+    }
+    factor += config.gravity * config.central_mass / ((r2 + config.epsilon) * r);
+    *ax -= factor * x;
+    *ay -= factor * y;
 }
 
-// Sleeps in the pool until job_start is fired.
-static void* update_stars_job(void* arg)
+// Potential of the background at a point, 0 at infinity. The isothermal and
+// logarithmic halos grow without bound, so nothing escapes them: -infinity.
+static double external_potential(double x, double y)
+{
+    double r2 = x*x + y*y;
+    double r = sqrt(r2) + 1e-12;
+    double potential = -config.gravity * config.central_mass / sqrt(r2 + config.epsilon);
+    switch (config.halo) {
+    case Config::Halo::nfw:
+        potential -= config.gravity * config.halo_mass * log1p(r / config.halo_radius) / r;
+        break;
+    case Config::Halo::isothermal:
+    case Config::Halo::logarithmic:
+        return -INFINITY;
+    default:
+        break;
+    }
+    return potential;
+}
+
+// A few flops per star instead of a halo of particles
+template<Config::Halo halo>
+static void add_external_accel(const double* x, const double* y, double* ax, double* ay, int n)
+{
+    for (int k = 0; k < n; k++)
+        add_halo_accel<halo>(x[k], y[k], &ax[k], &ay[k]);
+}
+
+static void add_external_accel(const double* x, const double* y, double* ax, double* ay, int n)
+{
+    switch (config.halo) {
+    case Config::Halo::none:
+        if (config.central_mass)
+            add_external_accel<Config::Halo::none>(x, y, ax, ay, n);
+        break;
+    case Config::Halo::nfw:
+        add_external_accel<Config::Halo::nfw>(x, y, ax, ay, n);
+        break;
+    case Config::Halo::isothermal:
+        add_external_accel<Config::Halo::isothermal>(x, y, ax, ay, n);
+        break;
+    case Config::Halo::logarithmic:
+        add_external_accel<Config::Halo::logarithmic>(x, y, ax, ay, n);
+        break;
+    }
+}
+
+static const int block_size = 64;  // stars a thread takes at once
+
+// [accel] is the new acceleration times half the frame time
+static inline void kick(int i, double accel_x, double accel_y)
+{
+    motion.vx[i] += motion.ax[i] + accel_x;  // velocity Verlet integration
+    motion.vy[i] += motion.ay[i] + accel_y;
+    motion.ax[i] = accel_x;
+    motion.ay[i] = accel_y;
+}
+
+template<typename real, bool periodic>
+MULTIVERSION static void update_stars(int thread)
+{
+    double x[block_size];
+    double y[block_size];
+    double ax[block_size];
+    double ay[block_size];
+    double half_time = frame_time / 2;
+    for (const species_range& species : star_species) {
+        int end = species.first + species.count;
+        for (int first = species.first + thread*block_size; first < end; first += cores*block_size) {
+            int n = std::min(block_size, end - first);
+            star* block = &stars[first];
+            for (int k = 0; k < n; k++) {
+                vec<real, 2> accel = { 0, 0 };
+                real softening = star_softening ? star_softening[first + k] : species.softening;
+                double2 position = block[k];
+                get_tree_accel<real, periodic>(&position, softening, &accel);
+                x[k] = position.x;
+                y[k] = position.y;
+                ax[k] = accel.x * config.gravity;
+                ay[k] = accel.y * config.gravity;
+            }
+            add_external_accel(x, y, ax, ay, n);
+            for (int k = 0; k < n; k++)
+                kick(first + k, ax[k] * half_time, ay[k] * half_time);
+        }
+    }
+}
+
+// Kick and drift the tracers. They aren't in the tree, so both fit in one pass.
+template<typename real, bool periodic>
+static void update_tracers(int thread)
+{
+    int end = (int)((long)config.tracers * (thread + 1) / cores);
+    for (int i = (int)((long)config.tracers * thread / cores); i < end; i++) {
+        struct tracer* tracer = &tracers[i];
+        vec<real, 2> tree_accel = { 0, 0 };
+        get_tree_accel<real, periodic>(tracer, (real)config.epsilon, &tree_accel);
+        double2 accel = vec_cast<double>(tree_accel) * config.gravity;
+        add_external_accel(&tracer->x, &tracer->y, &accel.x, &accel.y, 1);
+        accel *= frame_time / 2;
+        tracer->speed += tracer->accel + accel;  // velocity Verlet integration
+        tracer->accel = accel;
+        *tracer += frame_time * (tracer->speed + tracer->accel);
+        if (periodic) {
+            tracer->x = wrap(tracer->x);
+            tracer->y = wrap(tracer->y);
+        }
+        disp_tracer_position[i] = vec_cast<float>(*tracer);
+    }
+}
+
+// Sleeps in the pool until its job_start is fired.
+static void* pool_thread(void* arg)
 {
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL); // can be safely cancelled at any time.
     int thread = (int)(intptr_t)arg;
 
     while (true) {
-        sem_wait(&job_start);
-        update_stars(thread);
+        sem_wait(&job_start[thread]);
+        pool_job(thread);
         sem_post(&job_finish);
     }
 
     return NULL;
 }
 
+// Run job(thread) for every thread of the pool and wait for all of them
+void run_pool(void (*job)(int thread))
+{
+    pool_job = job;
+    for (int i = 1; i < cores; i++)
+        sem_post(&job_start[i]);
+    job(0);  // job #0 is run synchronously
+    for (int i = 1; i < cores; i++)
+        sem_wait(&job_finish);
+}
+
 // Taken from https://academo.org/demos/colour-temperature-relationship
-void temperature_to_color(double temperature, vec3 color)
+static void temperature_to_color(double temperature, float3& color)
 {
     // Red
     // TODO: make darker at lower temperatures
     if (temperature < 6688.07521717704)
-        color[0] = 1;
+        color.x = 1;
     else
-        color[0] = 2.38773765777 / pow(temperature-6000, 0.1332047592);
+        color.x = 2.38773765777 / pow(temperature-6000, 0.1332047592);
 
     // Green
     if (temperature < 505.19153525581)
-        color[1] = 0;
+        color.y = 0;
     else if (temperature < 6503.88567352958)
-        color[1] = 0.390081578769 * log(temperature) - 2.42823350043916;
+        color.y = 0.390081578769 * log(temperature) - 2.42823350043916;
     else
-        color[1] = 1.59980184855092 / pow(temperature-6000, 0.0755148492);
+        color.y = 1.59980184855092 / pow(temperature-6000, 0.0755148492);
 
     // Blue
     if (temperature < 1904.4958624097)
-        color[2] = 0;
+        color.z = 0;
     else if (temperature < 6700.43225118371)
-        color[2] = 0.54320678911 * log(temperature-1000) - 3.69781379917569;
+        color.z = 0.54320678911 * log(temperature-1000) - 3.69781379917569;
     else
-        color[2] = 1;
+        color.z = 1;
 }
 
 static inline double frand(double min, double max)
@@ -157,17 +588,212 @@ static inline double frand(double min, double max)
     return (double)rand()/RAND_MAX * (max-min) + min;
 }
 
+// A star with its motion, while it is out of the arrays
+struct loose_star: star
+{
+    double2 speed;
+    double2 accel;
+    double drawn_mass;  // before rounding to star_real, so that the order is the same in both builds
+};
+
+static void put_star(int i, const loose_star& star)
+{
+    stars[i] = star;
+    motion.vx[i] = star.speed.x;
+    motion.vy[i] = star.speed.y;
+    motion.ax[i] = star.accel.x;
+    motion.ay[i] = star.accel.y;
+}
+
 // assists qsorting
 static int mass_ascending(const void *a, const void *b)
 {
-    if (((struct star*)a)->mass < ((struct star*)b)->mass) return -1;
-    if (((struct star*)a)->mass > ((struct star*)b)->mass) return 1;
+    if (((loose_star*)a)->drawn_mass < ((loose_star*)b)->drawn_mass) return -1;
+    if (((loose_star*)a)->drawn_mass > ((loose_star*)b)->drawn_mass) return 1;
     return 0;
 }
 
+static void realloc_motion(star_motion* motion, int capacity)
+{
+    motion->vx = (star_real*)hot_realloc(memory_stars, motion->vx, capacity * sizeof(star_real));
+    motion->vy = (star_real*)hot_realloc(memory_stars, motion->vy, capacity * sizeof(star_real));
+    motion->ax = (star_real*)hot_realloc(memory_stars, motion->ax, capacity * sizeof(star_real));
+    motion->ay = (star_real*)hot_realloc(memory_stars, motion->ay, capacity * sizeof(star_real));
+}
+
+static void free_motion(star_motion* motion)
+{
+    tracked_free(motion->vx);
+    tracked_free(motion->vy);
+    tracked_free(motion->ax);
+    tracked_free(motion->ay);
+    *motion = { NULL, NULL, NULL, NULL };
+}
+
+// Copy [count] stars' motion from [src] to [dst], which may overlap
+static void move_motion(star_motion* to, int dst, const star_motion& from, int src, int count)
+{
+    memmove(&to->vx[dst], &from.vx[src], count * sizeof(star_real));
+    memmove(&to->vy[dst], &from.vy[src], count * sizeof(star_real));
+    memmove(&to->ax[dst], &from.ax[src], count * sizeof(star_real));
+    memmove(&to->ay[dst], &from.ay[src], count * sizeof(star_real));
+}
+
+// Grow the per-quad arrays to hold at least [count] quads, at least doubling them.
+// A k-d tree takes N-1 quads, a quadtree usually under 2N but more for close pairs.
+static void reserve_quads(size_t count)
+{
+    if (count <= quad_capacity)
+        return;
+    size_t capacity = std::max(count, 2 * quad_capacity);
+    quads = (quad*)hot_realloc(memory_tree, quads, capacity * sizeof(quad));
+    memset(quads + quad_capacity, 0, (capacity - quad_capacity) * sizeof(quad));
+    if (config.interaction_skin > 0 || config.density_neighbors > 0)
+        quad_stars = (int*)tracked_realloc(memory_tree, quad_stars, capacity * sizeof(int));
+    if (config.interaction_skin > 0) {
+        list_sizes = (double*)tracked_realloc(memory_tree, list_sizes, capacity * sizeof(double));
+        quad_bounds = (group_bounds*)tracked_realloc(memory_tree, quad_bounds, capacity * sizeof(group_bounds));
+    }
+    if (quad_softening)
+        quad_softening = (double*)tracked_realloc(memory_tree, quad_softening, capacity * sizeof(double));
+    quad_capacity = capacity;
+}
+
+// Grow the per-star arrays to hold at least [count] stars, at least doubling them.
+// Kept escapers take display slots after the stars, so they count too.
+static void reserve_stars(int count)
+{
+    count += escapers.size();
+    if (count <= star_capacity)
+        return;
+    int capacity = std::max(count, 2 * star_capacity);
+    int added = capacity - star_capacity;
+    stars = (star*)hot_realloc(memory_stars, stars, capacity * sizeof(star));
+    memset(stars + star_capacity, 0, added * sizeof(star));
+    realloc_motion(&motion, capacity);
+    reserve_quads(2 * (size_t)capacity);
+    star_states = (uint8_t*)tracked_realloc(memory_stars, star_states, capacity * sizeof(uint8_t));
+    memset(star_states + star_capacity, star_kept, added * sizeof(uint8_t));
+    if (config.refine_radius > 0) {
+        star_coarsening = (uint8_t*)tracked_realloc(memory_stars, star_coarsening, capacity * sizeof(uint8_t));
+        memset(star_coarsening + star_capacity, 0, added * sizeof(uint8_t));
+    }
+    if (spare_stars) {
+        spare_stars = (star*)hot_realloc(memory_stars, spare_stars, capacity * sizeof(star));
+        realloc_motion(&spare_motion, capacity);
+        spare_colors = (float3*)hot_realloc(memory_display, spare_colors, capacity * sizeof(float3));
+        if (star_coarsening)
+            spare_coarsening = (uint8_t*)tracked_realloc(memory_stars, spare_coarsening, capacity * sizeof(uint8_t));
+    }
+    if (config.engine == Config::Engine::kdtree)
+        kd_order = (int*)tracked_realloc(memory_tree, kd_order, capacity * sizeof(int));
+    if (config.interaction_skin > 0)
+        list_anchors = (double2*)tracked_realloc(memory_tree, list_anchors, capacity * sizeof(double2));
+    if (star_softening)
+        star_softening = (double*)tracked_realloc(memory_stars, star_softening, capacity * sizeof(double));
+    disp_star_position = (float2*)hot_realloc(memory_display, disp_star_position, capacity * sizeof(float2));
+    disp_star_color = (float3*)hot_realloc(memory_display, disp_star_color, capacity * sizeof(float3));
+    star_capacity = capacity;
+    disp_star_capacity = capacity;
+}
+
+// Softenings are kept per star and per node only when they differ
+static bool softening_varies()
+{
+    if (config.density_neighbors > 0 && config.adaptive_softening > 0)
+        return true;
+    for (const Config::Species& species : config.species)
+        if (species.softening != config.species[0].softening)
+            return true;
+    return false;
+}
+
+size_t estimate_world_memory(int count)
+{
+    bool compacting = config.merge_radius > 0 || config.refine_radius > 0 || config.escapers != Config::Escapers::off;
+    bool cached = config.interaction_skin > 0 && !config.box_size;
+    size_t star = sizeof(star) + 4 * sizeof(star_real) + sizeof(uint8_t) + sizeof(loose_star);  // and generated[]
+    size_t tree = 2 * sizeof(quad);
+    size_t analysis = 0;
+    size_t display = sizeof(float2) + sizeof(float3);
+    if (compacting)
+        star += sizeof(star) + 4 * sizeof(star_real) + sizeof(float3);
+    if (config.refine_radius > 0)
+        star += 2 * sizeof(uint8_t);
+    if (config.engine == Config::Engine::kdtree)
+        tree += sizeof(int);
+    if (cached) {  // members, sources and groups, the vectors up to half empty
+        double sources = 1.7 * pow(count, 0.4) * (config.accuracy / 0.7) * (config.accuracy / 0.7);  // per star, as measured
+        tree += sizeof(double2) + 2 * (sizeof(double) + sizeof(group_bounds) + sizeof(int) + (size_t)sources * sizeof(void*) + sizeof(interaction_group) / 8);
+    }
+    if (cached || config.density_neighbors > 0)
+        tree += 2 * sizeof(int);
+    if (config.fof_length > 0)
+        analysis += 2 * sizeof(int);
+    if (config.density_neighbors > 0)
+        analysis += sizeof(double);
+    if (softening_varies()) {
+        star += sizeof(double);
+        tree += 2 * sizeof(double);
+    }
+    size_t bytes = (size_t)count * (star + tree + analysis + display);
+    bytes += (size_t)config.tracers * (sizeof(struct tracer) + sizeof(float2));
+    if (config.box_size > 0)
+        bytes += (ewald_size+1) * (ewald_size+1) * sizeof(double2);
+    return bytes;
+}
+
+// MemoryBudget allows growing the per-star arrays to [count] stars
+static bool stars_fit(int count)
+{
+    count += escapers.size();
+    if (count <= star_capacity)
+        return true;
+    int capacity = std::max(count, 2 * star_capacity);
+    return memory_available(estimate_world_memory(capacity) - estimate_world_memory(star_capacity));
+}
+
+// A rotating disk of [count] stars of species #s
+static void generate_stars(int first, int count, size_t s, const double2& center, double rmax)
+{
+    tracked_vector<loose_star, memory_stars> generated(count);
+    for (loose_star* star = generated.data(); star < generated.data() + count; star++) {
+        double r = frand(0, rmax);
+        double dir = frand(0, 2*M_PI);
+        star->x = center.x + r * cos(dir);
+        star->y = center.y + r * sin(dir);
+        star->speed.x =  config.star_speed * pow(r, 0.25) * sin(dir);
+        star->speed.y = -config.star_speed * pow(r, 0.25) * cos(dir);
+        star->drawn_mass = frand(config.species[s].mass_min, config.species[s].mass_max);
+        star->mass = star->drawn_mass;
+        if (config.box_size > 0) {
+            star->x = wrap(star->x);
+            star->y = wrap(star->y);
+        }
+    }
+    qsort(generated.data(), count, sizeof(loose_star), mass_ascending);  // increases accumulation accuracy
+    for (int k = 0; k < count; k++)
+        put_star(first + k, generated[k]);
+}
+
 void init_world()
 {
-    assert(config.stars > 1);
+    // Invisible species go first, so that the displayed stars are contiguous
+    if (config.species.empty())
+        config.species.push_back({ "stars", config.stars, 1, 10, config.epsilon, true });
+    std::stable_partition(config.species.begin(), config.species.end(),
+            [](const Config::Species& species) { return !species.visible; });
+    config.stars = 0;
+    first_visible = -1;
+    for (const Config::Species& species : config.species) {
+        if (species.visible && first_visible < 0)
+            first_visible = config.stars;
+        star_species.push_back({ config.stars, species.count, species.softening, species.visible });
+        config.stars += species.count;
+    }
+    if (first_visible < 0)
+        first_visible = config.stars;
+    disp_stars = config.stars - first_visible;
 
     // Init threads
     cores = sysconf(_SC_NPROCESSORS_ONLN);
@@ -176,144 +802,1311 @@ void init_world()
         cores = 1;
     #endif
     if (cores > 1) {
-        sem_init(&job_start, 0, 0);
+        job_start = (sem_t*)malloc(cores * sizeof(sem_t));
+        for (int i = 1; i < cores; i++)
+            sem_init(&job_start[i], 0, 0);
         sem_init(&job_finish, 0, 0);
         threads = (pthread_t*)malloc(cores * sizeof(pthread_t));
         for (int i = 1; i < cores; i++)  // job #0 is run synchronously
-            pthread_create(&threads[i], NULL, &update_stars_job, (void*)(intptr_t)i);
+            pthread_create(&threads[i], NULL, &pool_thread, (void*)(intptr_t)i);
     }
 
     // Init stars
-    stars = (struct star*)calloc(config.stars, sizeof(struct star));
-    quads = (struct quad*)calloc(2 * config.stars, sizeof(struct quad));  // TODO: dynamic reallocation
-    disp_star_position = (vec2*)malloc(config.stars * sizeof(vec2));
-    disp_star_color = (vec3*)malloc(config.stars * sizeof(vec3));
+    select_kernels();
+    if (config.box_size > 0)
+        init_ewald_table();
+    reserve_stars(std::max(config.stars, 1));  // the root quad, even without stars
+    if (softening_varies()) {
+        star_softening = (double*)tracked_realloc(memory_stars, NULL, star_capacity * sizeof(double));
+        quad_softening = (double*)tracked_realloc(memory_tree, NULL, quad_capacity * sizeof(double));
+    }
     double rmax = sqrt(config.stars) / config.galaxy_density;
-    for (int i = 0; i < config.stars; i++) {
+    for (size_t s = 0; s < star_species.size(); s++)
+        generate_stars(star_species[s].first, star_species[s].count, s, { 0, 0 }, rmax);
+    for (int i = first_visible; i < config.stars; i++)
+        temperature_to_color(stars[i].mass * 1500, disp_star_color[i - first_visible]);
+    print_hot_memory_stats();
+
+    merge_candidates = new tracked_vector<std::pair<int, int>, memory_stars>[cores];
+    found_stars = new tracked_vector<int, memory_stars>[cores];
+    compact_offsets = (int*)tracked_realloc(memory_stars, NULL, cores * sizeof(int));
+
+    // Init tracers
+    disp_tracers = config.tracers;
+    tracers = (struct tracer*)tracked_realloc(memory_stars, NULL, config.tracers * sizeof(struct tracer));
+    memset(tracers, 0, config.tracers * sizeof(struct tracer));
+    disp_tracer_position = (float2*)tracked_realloc(memory_display, NULL, config.tracers * sizeof(float2));
+    for (int i = 0; i < config.tracers; i++) {
         double r = frand(0, rmax);
         double dir = frand(0, 2*M_PI);
-        stars[i].x = r * cos(dir);
-        stars[i].y = r * sin(dir);
-        stars[i].speed.x =  config.star_speed * pow(r, 0.25) * sin(dir);
-        stars[i].speed.y = -config.star_speed * pow(r, 0.25) * cos(dir);
-        stars[i].mass = frand(1, 10);
-        temperature_to_color(stars[i].mass * 1500, disp_star_color[i]);
+        tracers[i].x = r * cos(dir);
+        tracers[i].y = r * sin(dir);
+        tracers[i].speed.x =  config.star_speed * pow(r, 0.25) * sin(dir);
+        tracers[i].speed.y = -config.star_speed * pow(r, 0.25) * cos(dir);
+        if (config.box_size > 0) {
+            tracers[i].x = wrap(tracers[i].x);
+            tracers[i].y = wrap(tracers[i].y);
+        }
+        disp_tracer_position[i] = vec_cast<float>(tracers[i]);
     }
-    qsort(stars, config.stars, sizeof(struct star), mass_ascending);  // increases accumulation accuracy
 
     #if 0
         config.stars = 3;
         stars[0].x = 0.05;
         stars[0].y = 0;
-        stars[0].speed.x = 0;
-        stars[0].speed.y = -0.0;
+        motion.vx[0] = 0;
+        motion.vy[0] = -0.0;
         stars[0].mass = 1;
         stars[1].x = -0.05;
         stars[1].y = 0;
-        stars[1].speed.x = 0;
-        stars[1].speed.y = 0.0;
+        motion.vx[1] = 0;
+        motion.vy[1] = 0.0;
         stars[1].mass = 1;
         stars[2].x = 1000;
         stars[2].y = 1000;
     #endif
 }
 
+// Bit i of an orthant is set above the center along axis i. In the plane:
 // 2 3
 // 0 1
-static inline int get_quadrant(const struct quad *quad, const struct star *star)
+template<int N>
+static inline int get_orthant(const basic_quad<N>* node, const basic_star<N>* star)
 {
-    int quadrant = 0;
-    if (star->x > quad->center.x)
-        quadrant++;
-    if (star->y > quad->center.y)
-        quadrant += 2;
-    return quadrant;
+    int orthant = 0;
+    for (int i = 0; i < N; i++)
+        if ((*star)[i] > node->center[i])
+            orthant |= 1 << i;
+    return orthant;
 }
 
-void world_frame(double time)
+template<int N> MULTIVERSION
+static void get_star_bounds(const basic_star<N>* stars, int count, double* min, double* max)
 {
-    frame_time = time;
-    if (frame_time > 1/config.min_fps)
-        frame_time = 1/config.min_fps;
-    frame_time *= config.speed;
-
+    for (int i = 0; i < N; i++) {
+        min[i] = INFINITY;
+        max[i] = -INFINITY;
+    }
+    for (int k = 0; k < count; k++)
+        for (int i = 0; i < N; i++) {
+            double value = stars[k][i];
+            min[i] = value < min[i] ? value : min[i];
+            max[i] = value > max[i] ? value : max[i];
+        }
+}
 
-    //************************
-    // Build Barnes-Hut qtree
-    //************************
+// Build the Barnes-Hut tree from scratch: a quadtree in the plane, an octree in
+// space. [used] quads are cleared first, then counted. The root spans the box
+// if periodic. False if the quads ran out, as closer stars take more levels.
+template<int N>
+static bool build_orthtree(basic_star<N>* stars, int count, basic_quad<N>* quads, size_t capacity, size_t* used, double box_size)
+{
+    memset(quads, 0, *used * sizeof(basic_quad<N>));
+    *used = 1;
+    if (box_size > 0) {
+        for (int i = 0; i < N; i++)
+            quads[0].center[i] = 0;
+        quads[0].size = box_size;
+    } else {
+        double min[N];
+        double max[N];
+        get_star_bounds(stars, count, min, max);
+        double size = 0;
+        for (int i = 0; i < N; i++) {
+            quads[0].center[i] = (min[i] + max[i]) / 2;
+            size = max[i] - min[i] > size ? max[i] - min[i] : size;  // keep nodes square
+        }
+        quads[0].size = size;
+    }
 
-    // Root node
-    double xmin_world = INFINITY;
-    double ymin_world = INFINITY;
-    double xmax_world = -INFINITY;
-    double ymax_world = -INFINITY;
-    for (int i = 0; i < config.stars; i++) {
-        if (xmin_world > stars[i].x)
-            xmin_world = stars[i].x;
-        if (xmax_world < stars[i].x)
-            xmax_world = stars[i].x;
-        if (ymin_world > stars[i].y)
-            ymin_world = stars[i].y;
-        if (ymax_world < stars[i].y)
-            ymax_world = stars[i].y;
-    }
-    quads[0].center.x = (xmin_world+xmax_world)/2;
-    quads[0].center.y = (ymin_world+ymax_world)/2;
-    double size_x = xmax_world - xmin_world;
-    double size_y = ymax_world - ymin_world;
-    quads[0].size = size_x > size_y ? size_x : size_y;  // keep nodes square
-    size_t quad_count = 1;  // number of quads
-
-    // Build the tree
-    for (struct star* star = stars; star < stars + config.stars; star++) {
-        struct quad* quad = &quads[0];
+    for (basic_star<N>* star = stars; star < stars + count; star++) {
+        basic_quad<N>* node = &quads[0];
         do {
-            // Add star to current quad
-            double mass_sum = quad->mass + star->mass;
-            quad->x = (quad->x * quad->mass + star->x * star->mass) / mass_sum;
-            quad->y = (quad->y * quad->mass + star->y * star->mass) / mass_sum;
-            quad->mass = mass_sum;
-            int quadrant = get_quadrant(quad, star);
-            if (quad->children[quadrant] == NULL) {
-                quad->children[quadrant] = (struct quad*)star;
-            } else if (quad->children[quadrant]->size == 0) {
-                struct star* old_star = (struct star*)(quad->children[quadrant]);
-                struct quad* new_quad = &quads[quad_count];
-                quad_count++;
-                new_quad->x = old_star->x;
-                new_quad->y = old_star->y;
-                new_quad->mass = old_star->mass;
-                new_quad->size = quad->size/2;
-                double shift = quad->size/4;
-                new_quad->center.x = quad->center.x + (quadrant&0x1 ? shift : -shift);
-                new_quad->center.y = quad->center.y + (quadrant&0x2 ? shift : -shift);
-                new_quad->children[get_quadrant(new_quad, old_star)] = (struct quad*)old_star;
-                quad->children[quadrant] = new_quad;
+            // Add star to current node
+            double mass_sum = (double)node->mass + star->mass;  // exact, to match the weights below
+            for (int i = 0; i < N; i++)
+                (*node)[i] = ((*node)[i] * node->mass + (*star)[i] * star->mass) / mass_sum;
+            node->mass = mass_sum;
+            int orthant = get_orthant(node, star);
+            if (node->children[orthant] == NULL) {
+                node->children[orthant] = (basic_quad<N>*)star;
+            } else if (node->children[orthant]->size == 0) {
+                if (*used == capacity)
+                    return false;
+                basic_star<N>* old_star = (basic_star<N>*)(node->children[orthant]);
+                basic_quad<N>* new_node = &quads[(*used)++];
+                for (int i = 0; i < N; i++)
+                    (*new_node)[i] = (*old_star)[i];
+                new_node->mass = old_star->mass;
+                new_node->size = node->size/2;
+                double shift = node->size/4;
+                for (int i = 0; i < N; i++)
+                    new_node->center[i] = node->center[i] + (orthant >> i & 1 ? shift : -shift);
+                new_node->children[get_orthant(new_node, old_star)] = (basic_quad<N>*)old_star;
+                node->children[orthant] = new_node;
             }
-            quad = quad->children[quadrant];
-        } while (quad->size);
+            node = node->children[orthant];
+        } while (node->size);
     }
+    return true;
+}
 
+static bool build_quadtree()
+{
+    return build_orthtree(stars, config.stars, quads, quad_capacity, &quad_count, config.box_size);
+}
 
-    //*************************************
-    // Calculate acceleration and position
-    //*************************************
 
-    // Wake up the threads in the pool
-    for (int i = 1; i < cores; i++)
-        sem_post(&job_start);
-    update_stars(0);  // job #0 is run synchronously
-    for (int i = 1; i < cores; i++)
-        sem_wait(&job_finish);
+//*****************************
+// k-d tree
+//*****************************
+
+// Nodes are quads with two children, so the tree walks work unchanged.
+// A node's center and size describe the square around its bounding box.
+
+struct kd_task  // a subtree left to build
+{
+    int node;
+    int first;
+    int count;
+};
+
+static std::vector<kd_task> kd_tasks;
+static std::vector<int> kd_top_nodes;  // built before the tasks, in preorder
+
+// What a k-d build works on, in any dimension
+template<int N>
+struct kd_arrays
+{
+    basic_star<N>* stars;
+    basic_quad<N>* quads;
+    int* order;  // star indices, partitioned by the tree
+};
+
+// Bound stars [first, first+count) and split them at the median of the longest side.
+// Returns the number of stars on the left.
+template<int N>
+static int kd_split(const kd_arrays<N>& tree, basic_quad<N>* node, int first, int count)
+{
+    double min[N];
+    double max[N];
+    for (int i = 0; i < N; i++) {
+        min[i] = INFINITY;
+        max[i] = -INFINITY;
+    }
+    for (int k = first; k < first + count; k++) {
+        const basic_star<N>* star = &tree.stars[tree.order[k]];
+        for (int i = 0; i < N; i++) {
+            min[i] = fmin(min[i], (*star)[i]);
+            max[i] = fmax(max[i], (*star)[i]);
+        }
+    }
+    int axis = 0;
+    for (int i = 0; i < N; i++) {
+        node->center[i] = (min[i] + max[i]) / 2;
+        if (max[i] - min[i] > max[axis] - min[axis])
+            axis = i;
+    }
+    node->size = fmax(max[axis] - min[axis], std::numeric_limits<star_real>::min());  // 0 is a star
+
+    int* begin = tree.order + first;
+    int* middle = begin + count/2;
+    const basic_star<N>* stars = tree.stars;
+    std::nth_element(begin, middle, begin + count, [stars, axis](int a, int b) { return stars[a][axis] < stars[b][axis]; });
+    return count/2;
+}
+
+// Link the children of node #index; a single star is a child itself.
+// A subtree of n stars takes n-1 nodes, laid out in preorder.
+template<int N>
+static void kd_link(const kd_arrays<N>& tree, int index, int first, int left, int count)
+{
+    basic_quad<N>* node = &tree.quads[index];
+    node->children[0] = left == 1 ? (basic_quad<N>*)&tree.stars[tree.order[first]] : &tree.quads[index + 1];
+    node->children[1] = count - left == 1 ? (basic_quad<N>*)&tree.stars[tree.order[first + left]] : &tree.quads[index + left];
+    for (int c = 2; c < 1 << N; c++)
+        node->children[c] = NULL;
+}
+
+template<int N>
+static void kd_moments(basic_quad<N>* node)
+{
+    const basic_quad<N>* a = node->children[0];
+    const basic_quad<N>* b = node->children[1];
+    double mass = (double)a->mass + b->mass;
+    for (int i = 0; i < N; i++)
+        (*node)[i] = ((*a)[i] * a->mass + (*b)[i] * b->mass) / mass;
+    node->mass = mass;
+}
+
+template<int N>
+static void kd_build(const kd_arrays<N>& tree, int index, int first, int count)
+{
+    int left = kd_split(tree, &tree.quads[index], first, count);
+    kd_link(tree, index, first, left, count);
+    if (left > 1)
+        kd_build(tree, index + 1, first, left);
+    if (count - left > 1)
+        kd_build(tree, index + left, first + left, count - left);
+    kd_moments(&tree.quads[index]);
+}
+
+// The top levels are split serially, leaving a few subtrees per thread
+template<int N>
+static void kd_build_top(const kd_arrays<N>& tree, int index, int first, int count, int depth)
+{
+    if (!depth) {
+        kd_tasks.push_back({ index, first, count });
+        return;
+    }
+    kd_top_nodes.push_back(index);
+    int left = kd_split(tree, &tree.quads[index], first, count);
+    kd_link(tree, index, first, left, count);
+    if (left > 1)
+        kd_build_top(tree, index + 1, first, left, depth - 1);
+    if (count - left > 1)
+        kd_build_top(tree, index + left, first + left, count - left, depth - 1);
+}
+
+static kd_arrays<2> kd_tree;  // the arrays of the current build
+
+static void kd_build_tasks(int thread)
+{
+    for (size_t t = thread; t < kd_tasks.size(); t += cores)
+        kd_build(kd_tree, kd_tasks[t].node, kd_tasks[t].first, kd_tasks[t].count);
+}
+
+// A balanced binary tree split at star medians, whatever the clustering
+static void build_kdtree()
+{
+    for (int i = 0; i < config.stars; i++)
+        kd_order[i] = i;
+    kd_tasks.clear();
+    kd_top_nodes.clear();
+    kd_tree = { stars, quads, kd_order };
+    int depth = 0;
+    while ((1 << depth) < 4 * cores)
+        depth++;
+    kd_build_top(kd_tree, 0, 0, config.stars, depth);
+    run_pool(kd_build_tasks);
+    for (auto node = kd_top_nodes.rbegin(); node != kd_top_nodes.rend(); node++)
+        kd_moments(&quads[*node]);
+    quad_count = config.stars - 1;
+}
+
+// Under two stars neither tree can split: the root holds the star, if any, as its only child
+static void build_root_only()
+{
+    memset(quads, 0, quad_count * sizeof(quad));
+    quad_count = 1;
+    quads[0].size = config.box_size > 0 ? config.box_size : 1;
+    if (config.stars) {
+        quads[0].x = stars[0].x;
+        quads[0].y = stars[0].y;
+        quads[0].mass = stars[0].mass;
+        quads[0].center.x = config.box_size > 0 ? 0 : (double)stars[0].x;
+        quads[0].center.y = config.box_size > 0 ? 0 : (double)stars[0].y;
+        quads[0].children[0] = (quad*)&stars[0];
+    }
+}
+
+static void build_tree()
+{
+    lists_valid = false;
+    tree_slack = 0;
+    if (config.stars < 2)
+        build_root_only();
+    else if (config.engine == Config::Engine::kdtree)
+        build_kdtree();
+    else
+        while (!build_quadtree())
+            reserve_quads(2 * quad_capacity);
+}
+
+#ifdef COMPACT_STARS
+// Center the shared origin of the positions on the stars, on a grid of an eighth
+// of their extent so that it moves only as they drift. A periodic box stays centered.
+// The tree is rebuilt after a move, as the quads hold offsets from the old origin.
+static void rebase_positions()
+{
+    if (config.box_size > 0 || config.stars == 0)
+        return;
+    double min[2];
+    double max[2];
+    get_star_bounds(stars, config.stars, min, max);
+    double extent = fmax(max[0] - min[0], max[1] - min[1]);
+    if (!(extent < INFINITY))
+        return;
+    double step = exp2(ceil(log2(fmax(extent, 1)))) / 8;  // a power of 2
+    double origin[2];
+    double shift[2];
+    bool moved = false;
+    for (int i = 0; i < 2; i++) {
+        origin[i] = round((min[i] + max[i]) / 2 / step) * step;
+        shift[i] = grid_origin[i] - origin[i];
+        moved |= fabs(shift[i]) >= step;
+    }
+    if (!moved)
+        return;
+    for (int k = 0; k < config.stars; k++) {
+        stars[k].x.offset = (float)(stars[k].x.offset + shift[0]);
+        stars[k].y.offset = (float)(stars[k].y.offset + shift[1]);
+    }
+    grid_origin[0] = origin[0];
+    grid_origin[1] = origin[1];
+    lists_valid = false;
+}
+#endif
+
+
+//*****************************
+// Collisions and merging
+//*****************************
+
+// Collect close pairs of the same species, each pair once
+static void find_merge_candidates(int thread)
+{
+    tracked_vector<std::pair<int, int>, memory_stars>& candidates = merge_candidates[thread];
+    candidates.clear();
+    for (const species_range& species : star_species)
+    for (int i = species.first + thread; i < species.first + species.count; i += cores)
+        for_each_near(&quads[0], stars[i], config.merge_radius, [&](star* other) {
+            int j = other - stars;
+            if (j > i && j < species.first + species.count)
+                candidates.push_back({ i, j });
+        });
+}
+
+static inline int chunk_start(int thread, int count)
+{
+    return (int)((long)count * thread / cores);
+}
+
+static inline size_t species_of(int star)
+{
+    size_t s = 0;
+    while (star >= star_species[s].first + star_species[s].count)
+        s++;
+    return s;
+}
+
+static void count_survivors(int thread)
+{
+    int survivors = 0;
+    for (int i = chunk_start(thread, config.stars); i < chunk_start(thread+1, config.stars); i++)
+        survivors += (star_states[i] != star_removed);
+    compact_offsets[thread] = survivors;
+}
+
+static void move_survivors(int thread)
+{
+    int k = compact_offsets[thread];
+    for (int i = chunk_start(thread, config.stars); i < chunk_start(thread+1, config.stars); i++) {
+        uint8_t state = star_states[i];
+        star_states[i] = star_kept;
+        if (state == star_removed)
+            continue;
+        spare_stars[k] = stars[i];
+        move_motion(&spare_motion, k, motion, i, 1);
+        if (star_coarsening)
+            spare_coarsening[k] = star_coarsening[i];
+        if (i >= first_visible) {
+            if (state == star_merged)
+                temperature_to_color(stars[i].mass * 1500, spare_colors[k - new_first_visible]);
+            else
+                spare_colors[k - new_first_visible] = disp_star_color[i - first_visible];
+        }
+        k++;
+    }
+}
+
+// Remove the stars marked star_removed, keeping the order of the rest.
+// [dead] is the number of removed stars per species.
+static void compact_stars(const std::vector<int>& dead)
+{
+    if (!spare_stars) {
+        spare_stars = (star*)hot_realloc(memory_stars, NULL, star_capacity * sizeof(star));
+        realloc_motion(&spare_motion, star_capacity);
+        spare_colors = (float3*)hot_realloc(memory_display, NULL, star_capacity * sizeof(float3));
+        if (star_coarsening)
+            spare_coarsening = (uint8_t*)tracked_realloc(memory_stars, NULL, star_capacity * sizeof(uint8_t));
+    }
+
+    // Species ranges
+    int removed = 0;
+    new_first_visible = first_visible;
+    for (size_t s = 0; s < star_species.size(); s++) {
+        if (!star_species[s].visible)
+            new_first_visible -= dead[s];
+        star_species[s].first -= removed;
+        star_species[s].count -= dead[s];
+        removed += dead[s];
+    }
+
+    run_pool(count_survivors);
+    for (int i = 0, offset = 0; i < cores; i++) {
+        int survivors = compact_offsets[i];
+        compact_offsets[i] = offset;
+        offset += survivors;
+    }
+    run_pool(move_survivors);
+    std::swap(stars, spare_stars);
+    std::swap(motion, spare_motion);
+    std::swap(disp_star_color, spare_colors);
+    std::swap(star_coarsening, spare_coarsening);
+    config.stars -= removed;
+    first_visible = new_first_visible;
+    disp_stars = config.stars - first_visible;
+    disp_star_color_version++;
+    lists_valid = false;
+    density_stale = true;
+}
+
+// Star #j joins star #i, conserving mass and momentum
+static void merge_pair(int i, int j)
+{
+    star* a = &stars[i];
+    star* b = &stars[j];
+    double mass = (double)a->mass + b->mass;
+    a->x = (a->x * a->mass + b->x * b->mass) / mass;
+    a->y = (a->y * a->mass + b->y * b->mass) / mass;
+    motion.vx[i] = (motion.vx[i] * a->mass + motion.vx[j] * b->mass) / mass;
+    motion.vy[i] = (motion.vy[i] * a->mass + motion.vy[j] * b->mass) / mass;
+    motion.ax[i] = (motion.ax[i] * a->mass + motion.ax[j] * b->mass) / mass;
+    motion.ay[i] = (motion.ay[i] * a->mass + motion.ay[j] * b->mass) / mass;
+    a->mass = mass;
+    star_states[i] = star_merged;
+    star_states[j] = star_removed;
+}
+
+// Merge close pairs conserving mass and momentum; false if nothing was merged
+static bool merge_stars()
+{
+    run_pool(find_merge_candidates);
+
+    // Each star takes part in one merge per pass
+    bool merged = false;
+    std::vector<int> dead(star_species.size(), 0);
+    for (int thread = 0; thread < cores; thread++)
+    for (const auto& [i, j] : merge_candidates[thread]) {
+        if (star_states[i] != star_kept || star_states[j] != star_kept)
+            continue;
+        dead[species_of(j)]++;
+        merge_pair(i, j);
+        if (star_coarsening)
+            star_coarsening[i] = 0;  // a collision, not for rebalance() to undo
+        merged = true;
+    }
+
+    if (merged)
+        compact_stars(dead);
+    return merged;
+}
+
+
+//*****************************
+// Escapers
+//*****************************
+
+// Flag the stars beyond the escape radius or unbound from the galaxy as a whole
+// and the background potential, in the galaxy's frame
+static void find_escapers(int thread)
+{
+    tracked_vector<int, memory_stars>& found = found_stars[thread];
+    found.clear();
+    double radius_sqr = config.escape_radius * config.escape_radius;
+    for (int i = chunk_start(thread, config.stars); i < chunk_start(thread+1, config.stars); i++) {
+        double dx = stars[i].x - galaxy_center.x;
+        double dy = stars[i].y - galaxy_center.y;
+        double distance_sqr = dx*dx + dy*dy;
+        double vx = motion.vx[i] - galaxy_speed.x;
+        double vy = motion.vy[i] - galaxy_speed.y;
+        double speed_sqr = vx*vx + vy*vy;
+        bool far = radius_sqr > 0 && distance_sqr > radius_sqr;
+        double potential = -config.gravity * galaxy_mass / sqrt(distance_sqr + config.epsilon)
+                + external_potential(stars[i].x, stars[i].y);
+        bool unbound = speed_sqr / 2 + potential > 0;
+        if (far || unbound) {
+            star_states[i] = star_removed;
+            found.push_back(i);
+        }
+    }
+}
+
+// Take the escapers out of the tree, so that they don't stretch the root cell
+static void remove_escapers()
+{
+    galaxy_center = quads[0];  // the previous tree
+    galaxy_mass = quads[0].mass;
+    double2 momentum = { 0, 0 };
+    for (int i = 0; i < config.stars; i++)
+        momentum += motion.speed(i) * (double)stars[i].mass;
+    galaxy_speed = momentum / galaxy_mass;
+    run_pool(find_escapers);
+
+    std::vector<int> dead(star_species.size(), 0);
+    bool found = false;
+    for (int thread = 0; thread < cores; thread++)
+    for (int i : found_stars[thread]) {
+        dead[species_of(i)]++;
+        if (config.escapers == Config::Escapers::keep) {
+            bool visible = i >= first_visible;
+            float3 color = visible ? disp_star_color[i - first_visible] : float3{ 0, 0, 0 };
+            escapers.push_back({ { stars[i], motion.speed(i), motion.accel(i) }, stars[i].mass, color, visible });
+        }
+        found = true;
+    }
+    if (found)
+        compact_stars(dead);
+}
+
+// Visible escapers are displayed after the stars. Their colors are rewritten
+// whenever the star set has changed, as that overwrites them.
+static void show_escapers()
+{
+    int k = config.stars - first_visible;
+    bool recolor = escaper_colors_version != disp_star_color_version;
+    for (const escaper& escaper : escapers) {
+        if (!escaper.visible)
+            continue;
+        disp_star_position[k] = vec_cast<float>(escaper);
+        if (recolor)
+            disp_star_color[k] = escaper.color;
+        k++;
+    }
+    disp_stars = k;
+    escaper_colors_version = disp_star_color_version;
+}
+
+// Escapers feel the galaxy as a point of its total mass
+static void update_escapers(int thread)
+{
+    int count = escapers.size();
+    for (int i = chunk_start(thread, count); i < chunk_start(thread+1, count); i++) {
+        struct tracer* escaper = &escapers[i];
+        double dx = galaxy_center.x - escaper->x;
+        double dy = galaxy_center.y - escaper->y;
+        double distance_sqr = dx*dx + dy*dy;
+        double factor = config.gravity * galaxy_mass / ((distance_sqr + config.epsilon) * sqrt(distance_sqr));
+        double2 accel = { factor * dx, factor * dy };
+        add_external_accel(&escaper->x, &escaper->y, &accel.x, &accel.y, 1);
+        accel.x *= frame_time / 2;
+        accel.y *= frame_time / 2;
+        escaper->speed.x += escaper->accel.x + accel.x;  // velocity Verlet integration
+        escaper->speed.y += escaper->accel.y + accel.y;
+        escaper->accel = accel;
+        escaper->x += frame_time * (escaper->speed.x + escaper->accel.x);
+        escaper->y += frame_time * (escaper->speed.y + escaper->accel.y);
+    }
+}
+
+
+//*****************************
+// Friends of friends
+//*****************************
+
+// Lock-free union-find: roots are only ever linked to smaller roots, so the
+// forest stays acyclic whatever the interleaving. Finding halves the paths.
+static int fof_find(int i)
+{
+    while (true) {
+        int parent = std::atomic_ref<int>(fof_parent[i]).load(std::memory_order_relaxed);
+        if (parent == i)
+            return i;
+        int grandparent = std::atomic_ref<int>(fof_parent[parent]).load(std::memory_order_relaxed);
+        if (parent != grandparent)
+            std::atomic_ref<int>(fof_parent[i]).compare_exchange_weak(parent, grandparent, std::memory_order_relaxed);
+        i = grandparent;
+    }
+}
+
+static void fof_unite(int a, int b)
+{
+    while (true) {
+        a = fof_find(a);
+        b = fof_find(b);
+        if (a == b)
+            return;
+        if (a < b)
+            std::swap(a, b);
+        int expected = a;
+        if (std::atomic_ref<int>(fof_parent[a]).compare_exchange_strong(expected, b, std::memory_order_relaxed))
+            return;
+    }
+}
+
+static void fof_reset(int thread)
+{
+    for (int i = chunk_start(thread, config.stars); i < chunk_start(thread+1, config.stars); i++)
+        fof_parent[i] = i;
+}
+
+// Link every star with its neighbors within the linking length
+static void fof_link(int thread)
+{
+    for (int i = chunk_start(thread, config.stars); i < chunk_start(thread+1, config.stars); i++)
+        for_each_near(&quads[0], stars[i], config.fof_length, [&](star* other) {
+            int j = other - stars;
+            if (j > i)
+                fof_unite(i, j);
+        });
+}
+
+static void fof_flatten(int thread)
+{
+    for (int i = chunk_start(thread, config.stars); i < chunk_start(thread+1, config.stars); i++)
+        std::atomic_ref<int>(fof_parent[i]).store(fof_find(i), std::memory_order_relaxed);
+}
+
+// Groups of at least config.fof_min_stars, heaviest first
+static void find_fof_groups()
+{
+    if (fof_capacity < star_capacity) {
+        fof_capacity = star_capacity;
+        fof_parent = (int*)tracked_realloc(memory_analysis, fof_parent, fof_capacity * sizeof(int));
+    }
+    run_pool(fof_reset);
+    run_pool(fof_link);
+    run_pool(fof_flatten);
+
+    // Sum up by root
+    tracked_vector<int, memory_analysis> group_of(config.stars, -1);
+    std::vector<fof_group> groups;
     for (int i = 0; i < config.stars; i++) {
-        stars[i].x += frame_time * (stars[i].speed.x + stars[i].accel.x);  // velocity Verlet integration
-        stars[i].y += frame_time * (stars[i].speed.y + stars[i].accel.y);
+        int& g = group_of[fof_parent[i]];
+        if (g < 0) {
+            g = groups.size();
+            groups.push_back({ 0, 0, { 0, 0 }, { 0, 0 } });
+        }
+        fof_group& group = groups[g];
+        const star* star = &stars[i];
+        group.stars++;
+        group.mass += star->mass;
+        group.center.x += star->x * star->mass;
+        group.center.y += star->y * star->mass;
+        group.speed.x += motion.vx[i] * star->mass;
+        group.speed.y += motion.vy[i] * star->mass;
     }
+    fof_groups.clear();
+    for (fof_group& group : groups) {
+        if (group.stars < config.fof_min_stars)
+            continue;
+        group.center.x /= group.mass;
+        group.center.y /= group.mass;
+        group.speed.x /= group.mass;
+        group.speed.y /= group.mass;
+        fof_groups.push_back(group);
+    }
+    std::sort(fof_groups.begin(), fof_groups.end(),
+            [](const fof_group& a, const fof_group& b) { return a.mass > b.mass; });
+    fof_catalogs++;
+}
+
+
+//*****************************
+// Cached interaction lists
+//*****************************
+
+// Like Verlet lists in molecular dynamics, every group of nearby stars keeps
+// the nodes it would take as a whole, opened with a margin of [skin]. The
+// lists hold while no star has moved by more than skin/2: star to node
+// distances shrink by at most the skin, and node sizes must grow by at most
+// the skin. Meanwhile the tree is only refitted to the new positions.
+
+// Moments and bounds from the current positions, keeping the topology.
+// Children always come after their parents. Like the k-d build, a node is
+// fitted to the box around its stars rather than to its children's squares,
+// which would stick out further at every level; a box moves out by at most
+// skin/2 a side. False if a node still outgrew its size plus the skin.
+static bool refit_tree()
+{
+    for (size_t q = quad_count; q-- > 0; ) {
+        quad* node = &quads[q];
+        double mass = 0;
+        double x = 0;
+        double y = 0;
+        group_bounds bounds = { INFINITY, INFINITY, -INFINITY, -INFINITY };
+        for (const quad* child : node->children) {
+            if (!child)
+                continue;
+            mass += child->mass;
+            x += child->x * child->mass;
+            y += child->y * child->mass;
+            group_bounds inner = child->size ? quad_bounds[child - quads]
+                    : group_bounds{ child->x, child->y, child->x, child->y };
+            bounds.xmin = fmin(bounds.xmin, inner.xmin);
+            bounds.xmax = fmax(bounds.xmax, inner.xmax);
+            bounds.ymin = fmin(bounds.ymin, inner.ymin);
+            bounds.ymax = fmax(bounds.ymax, inner.ymax);
+        }
+        quad_bounds[q] = bounds;
+        node->mass = mass;
+        node->x = x / mass;
+        node->y = y / mass;
+        node->center.x = (bounds.xmin + bounds.xmax) / 2;
+        node->center.y = (bounds.ymin + bounds.ymax) / 2;
+        node->size = fmax(fmax(bounds.xmax - bounds.xmin, bounds.ymax - bounds.ymin), std::numeric_limits<star_real>::min());  // 0 is a star
+        if (node->size > list_sizes[q] + config.interaction_skin)
+            return false;
+    }
+    tree_slack = 0;
+    return true;
+}
+
+static void count_quad_stars()
+{
+    for (size_t q = quad_count; q-- > 0; ) {
+        quad_stars[q] = 0;
+        for (const quad* child : quads[q].children)
+            if (child)
+                quad_stars[q] += child->size ? quad_stars[child - quads] : 1;
+    }
+}
+
+// The largest subtrees of at most group_size stars
+static void find_groups(const quad* node, tracked_vector<const quad*, memory_tree>& groups)
+{
+    if (!node->size || quad_stars[node - quads] <= group_size) {
+        groups.push_back(node);
+        return;
+    }
+    for (const quad* child : node->children)
+        if (child)
+            find_groups(child, groups);
+}
+
+static void collect_members(const quad* node, tracked_vector<int, memory_tree>& members)
+{
+    if (!node->size) {
+        members.push_back((star*)node - stars);
+        return;
+    }
+    for (const quad* child : node->children)
+        if (child)
+            collect_members(child, members);
+}
+
+static void collect_sources(const quad* node, const group_bounds& bounds, source_list& sources)
+{
+    double dx = fmax(fmax(bounds.xmin - node->x, node->x - bounds.xmax), 0);
+    double dy = fmax(fmax(bounds.ymin - node->y, node->y - bounds.ymax), 0);
+    double skin = config.interaction_skin;
+    if (!node->size || sqrt(dx*dx + dy*dy) > (node->size + skin) * config.accuracy + skin) {
+        sources.push_back(node);
+        return;
+    }
+    for (const quad* child : node->children)
+        if (child)
+            collect_sources(child, bounds, sources);
+}
+
+static void build_thread_lists(int thread)
+{
+    interaction_lists& list = lists[thread];
+    list.groups.clear();
+    list.members.clear();
+    list.sources.clear();
+    for (size_t g = thread; g < group_roots.size(); g += cores) {
+        interaction_group group;
+        group.first_member = list.members.size();
+        collect_members(group_roots[g], list.members);
+        group.members = list.members.size() - group.first_member;
+        group_bounds bounds = { INFINITY, INFINITY, -INFINITY, -INFINITY };
+        for (int k = group.first_member; k < group.first_member + group.members; k++) {
+            const star* star = &stars[list.members[k]];
+            bounds.xmin = fmin(bounds.xmin, star->x);
+            bounds.xmax = fmax(bounds.xmax, star->x);
+            bounds.ymin = fmin(bounds.ymin, star->y);
+            bounds.ymax = fmax(bounds.ymax, star->y);
+            list_anchors[list.members[k]] = *star;
+        }
+        group.first_source = list.sources.size();
+        collect_sources(&quads[0], bounds, list.sources);
+        group.sources = list.sources.size() - group.first_source;
+        list.groups.push_back(group);
+    }
+}
+
+static void build_lists()
+{
+    if (!lists)
+        lists = new interaction_lists[cores];
+    count_quad_stars();
+    for (size_t q = 0; q < quad_count; q++)
+        list_sizes[q] = quads[q].size;
+    group_roots.clear();
+    find_groups(&quads[0], group_roots);
+    run_pool(build_thread_lists);
+    lists_valid = true;
+}
 
-    // Display coordinates in GLfloat[]
+// False once a star has left its skin
+static bool lists_hold()
+{
+    double limit_sqr = config.interaction_skin * config.interaction_skin / 4;
     for (int i = 0; i < config.stars; i++) {
-        disp_star_position[i][0] = stars[i].x;
-        disp_star_position[i][1] = stars[i].y;
+        double dx = stars[i].x - list_anchors[i].x;
+        double dy = stars[i].y - list_anchors[i].y;
+        if (dx*dx + dy*dy > limit_sqr)
+            return false;
+    }
+    return true;
+}
+
+// update_stars() without the tree walk. Members are the inner loop, so it vectorizes
+// while every member still sums its sources in order.
+template<typename real>
+MULTIVERSION static void update_groups(int thread)
+{
+    const interaction_lists& list = lists[thread];
+    double x[group_size];
+    double y[group_size];
+    double ax[group_size];
+    double ay[group_size];
+    real softening[group_size];
+    real uniform_softening = star_species[0].softening;
+    real accel_x[group_size];
+    real accel_y[group_size];
+    double half_time = frame_time / 2;
+    for (const interaction_group& group : list.groups) {
+        const int* members = list.members.data() + group.first_member;
+        const node* const* sources = list.sources.data() + group.first_source;
+        int n = group.members;
+        for (int k = 0; k < n; k++) {
+            x[k] = stars[members[k]].x;
+            y[k] = stars[members[k]].y;
+            softening[k] = star_softening ? star_softening[members[k]] : uniform_softening;
+            accel_x[k] = 0;
+            accel_y[k] = 0;
+        }
+        for (int s = 0; s < group.sources; s++) {
+            double source_x = sources[s]->x;
+            double source_y = sources[s]->y;
+            real mass = sources[s]->mass;
+            real source = star_softening ? source_softening(sources[s]) : 0;
+            for (int k = 0; k < n; k++) {
+                real dx = source_x - x[k];
+                real dy = source_y - y[k];
+                real distance_sqr = dx*dx + dy*dy;
+                real same = distance_sqr ? 0 : 1;  // the same star or another with its coordinates: dx = dy = 0
+                real accel_abs = mass / ((distance_sqr + std::max(softening[k], source)) * std::sqrt(distance_sqr) + same);
+                accel_x[k] += accel_abs * dx;
+                accel_y[k] += accel_abs * dy;
+            }
+        }
+        for (int k = 0; k < n; k++) {
+            ax[k] = accel_x[k] * config.gravity;
+            ay[k] = accel_y[k] * config.gravity;
+        }
+        add_external_accel(x, y, ax, ay, n);
+        for (int k = 0; k < n; k++)
+            kick(members[k], ax[k] * half_time, ay[k] * half_time);
+    }
+}
+
+template<typename real>
+static void select_kernels()
+{
+    if (config.box_size > 0) {
+        update_stars_job = update_stars<real, true>;
+        update_tracers_job = update_tracers<real, true>;
+    } else {
+        update_stars_job = update_stars<real, false>;
+        update_tracers_job = update_tracers<real, false>;
+    }
+    update_groups_job = update_groups<real>;
+}
+
+// Instantiations for every precision, one chosen at startup
+static void select_kernels()
+{
+    if (config.precision == Config::Precision::float32)
+        select_kernels<float>();
+    else
+        select_kernels<double>();
+
+    // The same choice as the MULTIVERSION resolvers
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    const char* isa = __builtin_cpu_supports("avx512f") ? "avx512f" : __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+#else
+    const char* isa = "generic";
+#endif
+    printf("Force kernels: %s, %s\n", isa, config.precision == Config::Precision::float32 ? "float" : "double");
+}
+
+
+//*****************************
+// Density
+//*****************************
+
+static const int max_neighbors = 64;
+
+// Stars of a leaf group start from each other, which bounds the rest of the search
+static void estimate_group_density(int thread)
+{
+    tracked_vector<int, memory_tree> members;
+    for (size_t g = thread; g < density_groups.size(); g += cores) {
+        members.clear();
+        collect_members(density_groups[g], members);
+        for (int i : members) {
+            neighbor items[max_neighbors];
+            neighbor_heap heap = { items, config.density_neighbors };
+            for (int j : members) {
+                double dx = stars[j].x - stars[i].x;
+                double dy = stars[j].y - stars[i].y;
+                if (j != i)
+                    heap.push(dx*dx + dy*dy, j);
+            }
+            if (density_groups[g] != &quads[0])
+                knn_search(&quads[0], stars[i], density_groups[g], heap);
+            if (!heap.count) {  // a lone star
+                star_density[i] = 0;
+                if (config.adaptive_softening > 0)
+                    star_softening[i] = star_species[species_of(i)].softening;
+                continue;
+            }
+            double mass = 0;
+            for (int k = 0; k < heap.count; k++)
+                mass += stars[items[k].star].mass;
+            double radius_sqr = fmax(items[0].distance_sqr, 1e-12);
+            star_density[i] = mass / (M_PI * radius_sqr);
+            if (config.adaptive_softening > 0)
+                star_softening[i] = config.adaptive_softening * radius_sqr;
+        }
+    }
+}
+
+// Surface density from the k nearest neighbors of every star
+static void estimate_density()
+{
+    if (density_capacity < star_capacity) {
+        density_capacity = star_capacity;
+        star_density = (double*)tracked_realloc(memory_analysis, star_density, density_capacity * sizeof(double));
+    }
+    count_quad_stars();
+    density_groups.clear();
+    find_groups(&quads[0], density_groups);
+    run_pool(estimate_group_density);
+    density_stale = false;
+
+    if (!config.density_color || first_visible == config.stars)
+        return;
+    double low = INFINITY;
+    double high = -INFINITY;
+    for (int i = first_visible; i < config.stars; i++) {
+        low = fmin(low, log(star_density[i]));
+        high = fmax(high, log(star_density[i]));
+    }
+    for (int i = first_visible; i < config.stars; i++) {
+        double level = high > low ? (log(star_density[i]) - low) / (high - low) : 0.5;
+        temperature_to_color(1500 + 10000 * level, disp_star_color[i - first_visible]);
+    }
+    disp_star_recolor_version++;
+}
+
+
+//*****************************
+// Spawning
+//*****************************
+
+void spawn_galaxy(double x, double y)
+{
+    spawn_requests.push_back({ x, y });
+}
+
+// Make room for added[s] more stars at the end of every species, moving the
+// later ones up. The caller fills the new stars and their colors.
+static void grow_species(const std::vector<int>& added)
+{
+    int total = 0;
+    new_first_visible = first_visible;
+    for (size_t s = 0; s < star_species.size(); s++) {
+        total += added[s];
+        if (!star_species[s].visible)
+            new_first_visible += added[s];
+    }
+    reserve_stars(config.stars + total);
+
+    int shift = total;
+    for (size_t s = star_species.size(); s-- > 0; ) {
+        species_range& species = star_species[s];
+        shift -= added[s];
+        memmove(&stars[species.first + shift], &stars[species.first], species.count * sizeof(star));
+        move_motion(&motion, species.first + shift, motion, species.first, species.count);
+        if (star_coarsening) {
+            memmove(&star_coarsening[species.first + shift], &star_coarsening[species.first], species.count);
+            memset(&star_coarsening[species.first + shift + species.count], 0, added[s]);
+        }
+        if (species.visible)
+            memmove(&disp_star_color[species.first + shift - new_first_visible],
+                    &disp_star_color[species.first - first_visible], species.count * sizeof(float3));
+        species.first += shift;
+        species.count += added[s];
+    }
+    config.stars += total;
+    first_visible = new_first_visible;
+    disp_stars = config.stars - first_visible;
+    disp_star_color_version++;
+    lists_valid = false;
+    density_stale = true;
+}
+
+// Add a galaxy of config.spawn_stars, split between the species as at the start
+static void spawn_stars(const double2& center)
+{
+    int initial = 0;
+    for (const Config::Species& species : config.species)
+        initial += species.count;
+    std::vector<int> added(star_species.size());
+    int total = 0;
+    for (size_t s = 0; s < star_species.size(); s++) {
+        added[s] = (long)config.spawn_stars * config.species[s].count / initial;
+        total += added[s];
+    }
+    if (!total)
+        return;
+    if (!stars_fit(config.stars + total)) {
+        check_memory_budget(estimate_world_memory(total), "New stars");
+        return;
+    }
+    grow_species(added);
+
+    double rmax = sqrt(total) / config.galaxy_density;
+    for (size_t s = 0; s < star_species.size(); s++) {
+        int end = star_species[s].first + star_species[s].count;
+        generate_stars(end - added[s], added[s], s, center, rmax);
+        if (star_species[s].visible)
+            for (int i = end - added[s]; i < end; i++)
+                temperature_to_color(stars[i].mass * 1500, disp_star_color[i - first_visible]);
+    }
+}
+
+
+//*****************************
+// Adaptive resolution
+//*****************************
+
+void set_focus(double x, double y)
+{
+    focus = { x, y };
+}
+
+// Follow the picked star until the star set changes and its index with it
+static void show_picked_star()
+{
+    if (picked_version != disp_star_color_version)
+        picked = -1;
+    disp_picked.index = picked;
+    if (picked < 0)
+        return;
+    disp_picked.mass = stars[picked].mass;
+    disp_picked.position = { stars[picked].x, stars[picked].y };
+    disp_picked.speed = motion.speed(picked);
+}
+
+void pick_star(double x, double y)
+{
+    picked = query_nearest(x, y);
+    picked_version = disp_star_color_version;
+    show_picked_star();
+}
+
+// Merge same-species stars sharing a tree node away from the focus.
+// Every star has one parent, so threads never touch the same stars.
+static void find_coarse_pairs(int thread)
+{
+    tracked_vector<int, memory_stars>& removed = found_stars[thread];
+    removed.clear();
+    double radius_sqr = config.coarse_radius * config.coarse_radius;
+    for (int q = chunk_start(thread, quad_count); q < chunk_start(thread+1, quad_count); q++) {
+        const quad* node = &quads[q];
+        double dx = node->x - focus.x;
+        double dy = node->y - focus.y;
+        if (dx*dx + dy*dy < radius_sqr)
+            continue;
+        int leaves[4];
+        int n = 0;
+        for (const quad* child : node->children)
+            if (child && child->size == 0)
+                leaves[n++] = (star*)child - stars;
+        for (int a = 0; a < n; a++)
+        for (int b = a + 1; b < n; b++) {
+            int i = leaves[a];
+            int j = leaves[b];
+            size_t s = species_of(i);
+            if (star_states[i] != star_kept || star_states[j] != star_kept || species_of(j) != s
+                    || stars[i].mass + stars[j].mass > config.coarse_mass * config.species[s].mass_max)
+                continue;
+            merge_pair(i, j);
+            star_coarsening[i] = std::min(std::max(star_coarsening[i], star_coarsening[j]) + 1, 255);
+            removed.push_back(j);
+        }
+    }
+}
+
+// Stars coarsened earlier that have come close to the focus. Stars merged by
+// collisions are left alone, or MergeRadius would join the halves again.
+static void find_heavy_stars(int thread)
+{
+    tracked_vector<int, memory_stars>& found = found_stars[thread];
+    found.clear();
+    double radius_sqr = config.refine_radius * config.refine_radius;
+    for (int i = chunk_start(thread, config.stars); i < chunk_start(thread+1, config.stars); i++) {
+        double dx = stars[i].x - focus.x;
+        double dy = stars[i].y - focus.y;
+        if (dx*dx + dy*dy < radius_sqr && star_coarsening[i])
+            found.push_back(i);
+    }
+}
+
+// Split the heavy stars near the focus in halves and merge the light ones far
+// from it, so that the star count follows the view. False if nothing changed.
+static bool rebalance()
+{
+    run_pool(find_coarse_pairs);
+    bool changed = false;
+    std::vector<int> dead(star_species.size(), 0);
+    for (int thread = 0; thread < cores; thread++)
+    for (int j : found_stars[thread]) {
+        dead[species_of(j)]++;
+        changed = true;
+    }
+    if (changed)
+        compact_stars(dead);
+
+    // The halves sit within the softening length, on opposite sides of the original
+    run_pool(find_heavy_stars);
+    int heavy = 0;
+    for (int thread = 0; thread < cores; thread++)
+        heavy += found_stars[thread].size();
+    if (!heavy || !stars_fit(config.stars + heavy))  // over MemoryBudget the view stays coarse
+        return changed;
+    std::vector<tracked_vector<loose_star, memory_stars>> halves(star_species.size());
+    std::vector<std::vector<uint8_t>> half_coarsening(star_species.size());
+    std::vector<int> added(star_species.size(), 0);
+    for (int thread = 0; thread < cores; thread++)
+    for (int i : found_stars[thread]) {
+        size_t s = species_of(i);
+        double offset = sqrt(star_species[s].softening) / 4;
+        double dir = frand(0, 2*M_PI);
+        star* star = &stars[i];
+        star->mass /= 2;
+        loose_star half = { *star, motion.speed(i), motion.accel(i) };
+        star->x += offset * cos(dir);
+        star->y += offset * sin(dir);
+        half.x -= offset * cos(dir);
+        half.y -= offset * sin(dir);
+        halves[s].push_back(half);
+        added[s]++;
+        half_coarsening[s].push_back(--star_coarsening[i]);
+        if (i >= first_visible)
+            temperature_to_color(star->mass * 1500, disp_star_color[i - first_visible]);
+    }
+    grow_species(added);
+    for (size_t s = 0; s < star_species.size(); s++) {
+        int first = star_species[s].first + star_species[s].count - added[s];
+        for (int k = 0; k < added[s]; k++) {
+            put_star(first + k, halves[s][k]);
+            star_coarsening[first + k] = half_coarsening[s][k];
+        }
+        if (star_species[s].visible)
+            for (int i = first; i < first + added[s]; i++)
+                temperature_to_color(stars[i].mass * 1500, disp_star_color[i - first_visible]);
+    }
+    return true;
+}
+
+// The species' softening per star unless it's adaptive, then the largest under every node
+static void update_softening()
+{
+    if (config.density_neighbors <= 0 || config.adaptive_softening <= 0)
+        for (const species_range& species : star_species)
+            std::fill(star_softening + species.first, star_softening + species.first + species.count, species.softening);
+    for (size_t q = quad_count; q-- > 0; ) {
+        double softening = 0;
+        for (const quad* child : quads[q].children)
+            if (child)
+                softening = fmax(softening, source_softening(child));
+        quad_softening[q] = softening;
+    }
+}
+
+MULTIVERSION static void drift_stars()
+{
+    double slack = tree_slack;
+    for (int i = 0; i < config.stars; i++) {
+        double2 d = frame_time * (motion.speed(i) + motion.accel(i));  // velocity Verlet integration
+        stars[i] += d;
+        double moved = fabs(d.x) > fabs(d.y) ? fabs(d.x) : fabs(d.y);
+        slack = moved > slack ? moved : slack;
+    }
+    tree_slack = slack;
+}
+
+// Display coordinates in GLfloat[]
+MULTIVERSION static void convert_positions()
+{
+    for (int i = first_visible; i < config.stars; i++) {
+        disp_star_position[i - first_visible] = vec_cast<float>((double2)stars[i]);
+    }
+}
+
+void world_frame(double time)
+{
+    static long frame = 0;
+    frame_time = time;
+    if (frame_time > 1/config.min_fps)
+        frame_time = 1/config.min_fps;
+    frame_time *= config.speed;
+    world_time += frame_time;
+
+    if (config.escapers != Config::Escapers::off && !config.box_size && quads[0].mass > 0)
+        remove_escapers();
+    for (const double2& center : spawn_requests)
+        spawn_stars(center);
+    spawn_requests.clear();
+#ifdef COMPACT_STARS
+    rebase_positions();
+#endif
+    bool cached = config.interaction_skin > 0 && !config.box_size;
+    if (!lists_valid || config.stars < 2 || !lists_hold() || !refit_tree())
+        build_tree();
+    if (config.merge_radius > 0 && frame % config.merge_every == 0 && merge_stars())
+        build_tree();
+    if (config.refine_radius > 0 && frame % config.rebalance_every == 0 && rebalance())
+        build_tree();
+    if (cached && !lists_valid)
+        build_lists();
+    if (config.fof_length > 0 && frame % config.fof_every == 0)
+        find_fof_groups();
+    if (config.density_neighbors > 0 && (density_stale || frame % config.density_every == 0))
+        estimate_density();
+    if (star_softening)
+        update_softening();
+    frame++;
+
+
+    //*************************************
+    // Calculate acceleration and position
+    //*************************************
+
+    run_pool(cached ? update_groups_job : update_stars_job);
+    if (config.tracers)
+        run_pool(update_tracers_job);  // before the stars move, as the tree leaves point to them
+    if (!escapers.empty()) {
+        galaxy_center = quads[0];
+        galaxy_mass = quads[0].mass;
+        run_pool(update_escapers);
     }
-    memset(quads, 0, quad_count * sizeof(struct quad));
+    drift_stars();
+    if (config.box_size > 0)
+        for (int i = 0; i < config.stars; i++) {
+            stars[i].x = wrap(stars[i].x);
+            stars[i].y = wrap(stars[i].y);
+        }
+    convert_positions();
+    if (!escapers.empty())
+        show_escapers();
+    show_picked_star();
 }
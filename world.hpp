@@ -1,8 +1,186 @@
 #ifndef WORLD_H
 #define WORLD_H
 
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include "common.hpp"
+#include "memory.hpp"
+
+#ifdef COMPACT_STARS
+
+// The compact build keeps star state in single precision. Positions are float
+// offsets from an origin shared by all stars, which follows them on a coarse
+// grid, so that they keep about 1e-7 of the stars' extent wherever the stars
+// drift; stars spread far apart share the precision of their whole extent.
+// A star node takes 16 bytes instead of 32, its motion 16 instead of 32 and a
+// tree node 56 instead of 80.
+typedef float star_real;  // masses, sizes, speeds and accelerations
+
+extern double grid_origin[2];  // shared by the positions, moved by world_frame()
+
+// A coordinate along axis A as a float offset from the shared origin.
+// Reads and writes convert from and to double, exactly up to the offset's rounding.
+template<int A>
+struct grid_coord
+{
+    float offset;
+
+    operator double() const { return grid_origin[A] + offset; }
+    grid_coord& operator=(double value) { offset = (float)(value - grid_origin[A]); return *this; }
+    grid_coord& operator+=(double d) { return *this = (double)*this + d; }
+    grid_coord& operator-=(double d) { return *this = (double)*this - d; }
+};
+
+// A coordinate along either axis, for loops over the axes
+struct grid_ref
+{
+    float& offset;
+    int axis;
+
+    operator double() const { return grid_origin[axis] + offset; }
+    grid_ref& operator=(double value) { offset = (float)(value - grid_origin[axis]); return *this; }
+    grid_ref& operator=(const grid_ref& other) { return *this = (double)other; }
+};
+
+template<int N> struct basic_node;  // the compact build is planar
+template<int N> struct basic_tree_point;
+
+// Star or quadrant
+template<>
+struct basic_node<2>
+{
+    grid_coord<0> x;  // center of mass
+    grid_coord<1> y;
+    float mass;
+    float size;  // zero for a star
+
+    grid_ref operator[](int i) { return { i ? y.offset : x.offset, i }; }
+    double operator[](int i) const { return i ? (double)y : (double)x; }
+    operator double2() const { return { x, y }; }
+    basic_node& operator=(const double2& position) { x = position.x; y = position.y; return *this; }
+    basic_node& operator+=(const double2& d) { return *this = (double2)*this + d; }
+};
+
+// 4-byte aligned, unlike double2, so that a quad packs into 56 bytes
+template<>
+struct basic_tree_point<2>
+{
+    grid_coord<0> x;
+    grid_coord<1> y;
+
+    grid_ref operator[](int i) { return { i ? y.offset : x.offset, i }; }
+    double operator[](int i) const { return i ? (double)y : (double)x; }
+};
+
+#else
+
+typedef double star_real;
+
+// Star or node of an N-dimensional tree
+template<int N>
+struct basic_node: vec<double, N>  // the vector is the center of mass
+{
+    double mass;
+    double size;  // zero for a star
+};
+
+template<int N>
+using basic_tree_point = vec<double, N>;
+
+#endif
+
+// A tree leaf; the star's motion is in star_motion, at the same index
+template<int N>
+struct basic_star: basic_node<N>
+{
+};
+
+// A node of 2^N orthants: quadrants in the plane, octants in space
+template<int N>
+struct basic_quad: basic_node<N>
+{
+    basic_tree_point<N> center;  // geometrical center
+    basic_quad* children[1 << N];
+};
+
+// The simulation is planar
+typedef basic_node<2> node;
+typedef basic_star<2> star;
+typedef basic_quad<2> quad;
+typedef basic_tree_point<2> tree_point;
+
+// Massless test particle: feels gravity, but isn't in the tree
+struct tracer: double2
+{
+    double2 speed;
+    double2 accel;  // already multiplied by t/2
+};
+
+// A star taken out of the tree by Escapers keep. It feels the galaxy as a
+// point, and is still drawn and exported, after the stars.
+struct escaper: tracer
+{
+    double mass;
+    float3 color;
+    bool visible;
+};
+
+// Stars of a species are contiguous in stars[], invisible species first
+struct species_range
+{
+    int first;
+    int count;
+    double softening;
+    bool visible;
+};
+
+// Speeds and accelerations of stars[], one array per component, so that
+// per-star loops stream just the components they use
+struct star_motion
+{
+    star_real* vx;
+    star_real* vy;
+    star_real* ax;  // already multiplied by t/2, for better performance
+    star_real* ay;
+
+    double2 speed(int i) const { return { vx[i], vy[i] }; }
+    double2 accel(int i) const { return { ax[i], ay[i] }; }
+};
+
+extern star* stars;
+extern star_motion motion;
+extern quad* quads;
+extern tracer* tracers;
+extern tracked_vector<escaper, memory_stars> escapers;
+extern double world_time;
+extern std::vector<species_range> star_species;
+extern int first_visible;  // stars before it are not displayed
+
+// A friends-of-friends group
+struct fof_group
+{
+    int stars;
+    double mass;
+    double2 center;  // of mass
+    double2 speed;  // of the center of mass
+};
+
+extern std::vector<fof_group> fof_groups;  // the latest catalog, heaviest first
+extern int fof_catalogs;  // catalogs made so far
+extern double* star_density;  // per star, with DensityNeighbors
+extern double tree_slack;  // how far stars may have left their tree nodes since the tree was built
+extern int cores;  // threads in the pool
+
+void run_pool(void (*job)(int thread));
+
 void init_world();
 void world_frame(double time);
+void spawn_galaxy(double x, double y);  // at the start of the next frame
+void set_focus(double x, double y);  // where adaptive resolution is the highest
+void pick_star(double x, double y);  // the nearest star, followed in disp_picked
+double node_softening(const node* node);  // of a star, or the largest under a quad
 void finalize_world();
+size_t estimate_world_memory(int stars);  // bytes with the current configuration
 
 #endif // WORLD_H